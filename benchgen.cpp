@@ -0,0 +1,163 @@
+//This program writes large synthetic assembly programs for benchmarking
+//assemble: functions full of densely labelled loops, heavy pseudo-op use
+//and big .word tables that refer back to labels. The output depends only
+//on the options, so runs on different machines assemble the same input.
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/**
+ * Small deterministic generator (xorshift64*), so output does not depend
+ * on the standard library's distributions.
+ */
+class Random
+{
+public:
+    explicit Random(uint64_t seed) : state(seed ? seed : 1) {}
+    uint64_t next()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1DULL;
+    }
+    int below(int n) { return static_cast<int>(next() % static_cast<uint64_t>(n)); }
+
+private:
+    uint64_t state;
+};
+
+const char* const TEMPS[] = {"$t0", "$t1", "$t2", "$t3", "$t4", "$t5", "$t6", "$t7",
+                             "$s0", "$s1", "$s2", "$s3", "$a0", "$a1", "$v1", "$t8"};
+
+/**
+ * Write one source file of about `lines` lines. Functions are named
+ * f<file>_<n> and tables d<file>_<n>; calls and table references may go
+ * to any file, so multi-file programs exercise the link step.
+ */
+void write_file(std::ostream& out, Random& rng, int file, int files, long lines)
+{
+    const int FUNCTION_LINES = 64;  // roughly, including labels
+    const int TABLE_WORDS = 256;
+    long functions = std::max(1L, lines * 4 / 5 / FUNCTION_LINES);
+    long tables = std::max(1L, lines / 5 / (TABLE_WORDS / 8));
+
+    auto reg = [&]() { return TEMPS[rng.below(16)]; };
+    auto other_function = [&]()
+    {
+        return "f" + std::to_string(rng.below(files)) + "_" + std::to_string(rng.below(static_cast<int>(functions)));
+    };
+
+    out << "# generated by benchgen: file " << file << " of " << files << "\n";
+    out << ".data\n";
+    for (long t = 0; t < tables; t++)
+    {
+        out << "d" << file << "_" << t << ":\n";
+        for (int w = 0; w < TABLE_WORDS; w += 8)
+        {
+            out << "    .word ";
+            for (int k = 0; k < 8; k++)
+            {
+                if (k) out << ", ";
+                switch (rng.below(4))
+                {
+                    case 0:  out << other_function(); break;
+                    case 1:  out << "d" << file << "_" << rng.below(static_cast<int>(tables)); break;
+                    case 2:  out << "0x" << std::hex << rng.next() % 0xFFFFFFFF << std::dec; break;
+                    default: out << static_cast<int>(rng.next() % 2001) - 1000; break;
+                }
+            }
+            out << "\n";
+        }
+    }
+
+    out << ".text\n";
+    if (file == 0)
+    {
+        out << "main:\n"
+            << "    jal f0_0\n"
+            << "    addi $v0, $0, 10\n"
+            << "    syscall\n";
+    }
+    for (long f = 0; f < functions; f++)
+    {
+        std::string name = "f" + std::to_string(file) + "_" + std::to_string(f);
+        out << name << ":\n"
+            << "    addi $sp, $sp, -8\n"
+            << "    sw $ra, 4($sp)  # save the return address\n";
+        int blocks = 8;
+        for (int b = 0; b < blocks; b++)
+        {
+            out << name << "_L" << b << ":\n";
+            for (int i = 0; i < 6; i++)
+            {
+                switch (rng.below(16))
+                {
+                    case 0:  out << "    add " << reg() << ", " << reg() << ", " << reg() << "\n"; break;
+                    case 1:  out << "    sub " << reg() << ", " << reg() << ", " << reg() << "\n"; break;
+                    case 2:  out << "    addi " << reg() << ", " << reg() << ", " << rng.below(2000) - 1000 << "\n"; break;
+                    case 3:  out << "    lw " << reg() << ", " << 4 * rng.below(64) << "(" << reg() << ")\n"; break;
+                    case 4:  out << "    sw " << reg() << ", " << 4 * rng.below(64) << "(" << reg() << ")\n"; break;
+                    case 5:  out << "    la " << reg() << ", d" << file << "_" << rng.below(static_cast<int>(tables)) << "\n"; break;
+                    case 6:  out << "    slt " << reg() << ", " << reg() << ", " << reg() << "\n"; break;
+                    case 7:  out << "    sge " << reg() << ", " << reg() << ", " << reg() << "\n"; break;
+                    case 8:  out << "    seq " << reg() << ", " << reg() << ", " << reg() << "\n"; break;
+                    case 9:  out << "    sne " << reg() << ", " << reg() << ", " << reg() << "\n"; break;
+                    case 10: out << "    abs " << reg() << ", " << reg() << "\n"; break;
+                    case 11: out << "    sll " << reg() << ", " << reg() << ", " << rng.below(32) << "\n"; break;
+                    case 12: out << "    mult " << reg() << ", " << reg() << "\n    mflo " << reg() << "\n"; break;
+                    case 13: out << "    sgt " << reg() << ", " << reg() << ", " << reg() << "   # compare\n"; break;
+                    case 14: out << "    sle " << reg() << ", " << reg() << ", " << reg() << "\n"; break;
+                    default: out << "    jal " << other_function() << "\n"; break;
+                }
+            }
+            static const char* const BRANCHES[] = {"beq", "bne", "blt", "bge", "bgt", "ble"};
+            out << "    " << BRANCHES[rng.below(6)] << " " << reg() << ", " << reg() << ", "
+                << name << "_L" << rng.below(blocks) << "\n";
+        }
+        out << "    lw $ra, 4($sp)\n"
+            << "    addi $sp, $sp, 8\n"
+            << "    jr $ra\n\n";
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    long lines = 1000000;
+    int files = 1;
+    uint64_t seed = 1;
+    const char* out_name = nullptr;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--lines" && i + 1 < argc) lines = std::strtol(argv[++i], nullptr, 0);
+        else if (arg == "--files" && i + 1 < argc) files = std::atoi(argv[++i]);
+        else if (arg == "--seed" && i + 1 < argc) seed = std::strtoull(argv[++i], nullptr, 0);
+        else out_name = argv[i];
+    }
+    if (!out_name || lines < 1 || files < 1)
+    {
+        std::cerr
+            << "Expected Usage:\n"
+            << "  ./benchgen [--lines n] [--files k] [--seed s] out\n"
+            << "  Writes about n lines in total to out (k = 1) or to out0.asm ... out<k-1>.asm\n";
+        exit(1);
+    }
+
+    Random rng(seed);
+    for (int file = 0; file < files; file++)
+    {
+        std::string path = files == 1 ? out_name : out_name + std::to_string(file) + ".asm";
+        std::ofstream out(path);
+        write_file(out, rng, file, files, lines / files);
+        if (!out)
+        {
+            std::cerr << "Error: could not write " << path << std::endl;
+            exit(1);
+        }
+    }
+    return 0;
+}
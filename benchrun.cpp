@@ -0,0 +1,247 @@
+//This program benchmarks assemble: it runs it several times over each
+//given program and reports lines/s, MB/s, peak memory and the time of each
+//phase (from assemble --time), then checks that the test cases still
+//assemble to their gold binaries. Results also go to a JSON file.
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * Test cases whose gold binaries this assembler reproduces. The other gold
+ * binaries were made with a different la and syscall encoding.
+ */
+struct GoldCase
+{
+    const char* name;
+    const char* static_bin;
+    const char* inst_bin;
+    std::vector<const char*> inputs;
+};
+
+const GoldCase GOLD_CASES[] = {
+    {"demo1", "demo1_static.bin", "demo1_inst.bin", {"demo1.asm"}},
+    {"test1", "test1static.bin", "test1inst.bin", {"test1.asm"}},
+    {"test2", "test2static.bin", "test2inst.bin", {"test2.asm"}},
+};
+
+/**
+ * One run of assemble: wall time, peak resident memory and the phase
+ * times it printed.
+ */
+struct Run
+{
+    bool ok = false;
+    double seconds = 0;
+    long peak_rss_kb = 0; // ru_maxrss: kilobytes on Linux
+    std::vector<std::pair<std::string, double>> phases;
+};
+
+Run run_assemble(const std::string& assemble, const std::vector<std::string>& args)
+{
+    Run run;
+    int err[2];
+    if (pipe(err) != 0) return run;
+
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        dup2(err[1], 2);
+        close(err[0]);
+        close(err[1]);
+        std::vector<char*> argv;
+        argv.push_back(const_cast<char*>(assemble.c_str()));
+        for (const std::string& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+        argv.push_back(nullptr);
+        execv(assemble.c_str(), argv.data());
+        _exit(127);
+    }
+    close(err[1]);
+    if (pid < 0)
+    {
+        close(err[0]);
+        return run;
+    }
+
+    std::string output;
+    char buffer[4096];
+    for (ssize_t n; (n = read(err[0], buffer, sizeof(buffer))) > 0; ) output.append(buffer, static_cast<std::size_t>(n));
+    close(err[0]);
+
+    int status = 0;
+    struct rusage usage {};
+    wait4(pid, &status, 0, &usage);
+    run.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    run.peak_rss_kb = usage.ru_maxrss;
+    run.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (!run.ok) std::cerr << output;
+
+    std::istringstream lines(output);
+    for (std::string word, name; lines >> word; )
+    {
+        double seconds;
+        if (word == "phase" && lines >> name >> seconds) run.phases.emplace_back(name, seconds);
+    }
+    return run;
+}
+
+bool read_file(const std::string& path, std::string& contents)
+{
+    std::ifstream file(path, std::ios::binary);
+    std::ostringstream buffer;
+    buffer << file.rdbuf();
+    contents = buffer.str();
+    return static_cast<bool>(file);
+}
+
+std::string json_string(const std::string& s)
+{
+    std::string out = "\"";
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+int main(int argc, char* argv[])
+{
+    std::string assemble = "./assemble";
+    std::string results_path = "bench_results.json";
+    std::string testcases = "Testcases";
+    int runs = 3;
+    std::vector<std::string> programs;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--assemble" && i + 1 < argc) assemble = argv[++i];
+        else if (arg == "--results" && i + 1 < argc) results_path = argv[++i];
+        else if (arg == "--testcases" && i + 1 < argc) testcases = argv[++i];
+        else if (arg == "--runs" && i + 1 < argc) runs = std::max(1, std::atoi(argv[++i]));
+        else programs.push_back(arg);
+    }
+    if (programs.empty())
+    {
+        std::cerr
+            << "Expected Usage:\n"
+            << "  ./benchrun [--assemble path] [--runs n] [--results file] [--testcases dir] "
+            << "name=file1.asm[,file2.asm...] ...\n"
+            << "  Assembles each program n times and keeps the fastest run.\n";
+        exit(1);
+    }
+
+    const std::string static_out = "bench_static.bin";
+    const std::string inst_out = "bench_inst.bin";
+    bool failed = false;
+    std::ostringstream json;
+    json << std::setprecision(6) << "{\n  \"programs\": [";
+
+    for (std::size_t p = 0; p < programs.size(); p++)
+    {
+        std::size_t eq = programs[p].find('=');
+        std::string name = eq == std::string::npos ? programs[p] : programs[p].substr(0, eq);
+        std::string list = eq == std::string::npos ? programs[p] : programs[p].substr(eq + 1);
+
+        std::vector<std::string> args = {"--time"};
+        long lines = 0;
+        double bytes = 0;
+        std::istringstream files(list);
+        for (std::string file; std::getline(files, file, ','); )
+        {
+            std::string contents;
+            if (!read_file(file, contents))
+            {
+                std::cerr << "Error: could not read " << file << std::endl;
+                exit(1);
+            }
+            lines += static_cast<long>(std::count(contents.begin(), contents.end(), '\n'));
+            bytes += static_cast<double>(contents.size());
+            args.push_back(file);
+        }
+        args.push_back(static_out);
+        args.push_back(inst_out);
+
+        Run best;
+        for (int r = 0; r < runs; r++)
+        {
+            Run run = run_assemble(assemble, args);
+            if (!run.ok)
+            {
+                best = run;
+                break;
+            }
+            if (r == 0 || run.seconds < best.seconds) best = run;
+        }
+        if (!best.ok)
+        {
+            std::cerr << "Error: assemble failed on " << name << std::endl;
+            failed = true;
+        }
+
+        double lines_per_second = best.seconds > 0 ? lines / best.seconds : 0;
+        double mb_per_second = best.seconds > 0 ? bytes / 1e6 / best.seconds : 0;
+        std::cout << std::left << std::setw(12) << name << std::right << std::fixed
+                  << std::setw(10) << lines << " lines " << std::setw(8) << std::setprecision(3) << best.seconds << " s "
+                  << std::setw(12) << std::setprecision(0) << lines_per_second << " lines/s "
+                  << std::setw(8) << std::setprecision(1) << mb_per_second << " MB/s "
+                  << std::setw(8) << best.peak_rss_kb / 1024 << " MB peak";
+        for (const auto& phase : best.phases) std::cout << "  " << phase.first << " " << std::setprecision(3) << phase.second;
+        std::cout << std::endl;
+
+        json << (p ? "," : "") << "\n    {\"name\": " << json_string(name) << ", \"ok\": " << (best.ok ? "true" : "false")
+             << ", \"lines\": " << lines << ", \"bytes\": " << static_cast<long>(bytes) << ", \"runs\": " << runs
+             << ", \"seconds\": " << best.seconds << ", \"lines_per_second\": " << lines_per_second
+             << ", \"mb_per_second\": " << mb_per_second << ", \"peak_rss_kb\": " << best.peak_rss_kb << ", \"phases\": {";
+        for (std::size_t i = 0; i < best.phases.size(); i++)
+        {
+            json << (i ? ", " : "") << json_string(best.phases[i].first) << ": " << best.phases[i].second;
+        }
+        json << "}}";
+    }
+
+    // The encoding must not change: compare against the gold binaries.
+    json << "\n  ],\n  \"gold\": [";
+    bool first_case = true;
+    for (const GoldCase& gold : GOLD_CASES)
+    {
+        std::vector<std::string> args;
+        for (const char* input : gold.inputs) args.push_back(testcases + "/Assembly/" + input);
+        args.push_back(static_out);
+        args.push_back(inst_out);
+        std::string expected_static, expected_inst, actual_static, actual_inst;
+        bool ok = run_assemble(assemble, args).ok &&
+                  read_file(testcases + "/GoldBinaries/" + gold.static_bin, expected_static) &&
+                  read_file(testcases + "/GoldBinaries/" + gold.inst_bin, expected_inst) &&
+                  read_file(static_out, actual_static) && read_file(inst_out, actual_inst) &&
+                  actual_static == expected_static && actual_inst == expected_inst;
+        std::cout << "gold " << gold.name << (ok ? " ok" : " MISMATCH") << std::endl;
+        failed |= !ok;
+        json << (first_case ? "" : ",") << "\n    {\"name\": " << json_string(gold.name) << ", \"ok\": " << (ok ? "true" : "false") << "}";
+        first_case = false;
+    }
+    json << "\n  ],\n  \"ok\": " << (failed ? "false" : "true") << "\n}\n";
+    std::remove(static_out.c_str());
+    std::remove(inst_out.c_str());
+
+    std::ofstream results(results_path);
+    results << json.str();
+    if (!results)
+    {
+        std::cerr << "Error: could not write " << results_path << std::endl;
+        exit(1);
+    }
+    std::cout << "results written to " << results_path << std::endl;
+    return failed ? 1 : 0;
+}
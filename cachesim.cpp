@@ -0,0 +1,445 @@
+//This program runs a program produced by assemble and feeds every
+//instruction fetch and every lw/sw through a model of a cache hierarchy.
+//It reports hit and miss rates per cache level, per text label, per pc
+//range and per data label. Accesses are counted as they happen, so traces
+//of any length run in constant memory.
+#include "simulator.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+enum class Policy { LRU, FIFO, Random };
+
+struct CacheConfig
+{
+    std::string name;
+    size_t size;
+    size_t assoc;
+    size_t line;
+    Policy policy;
+};
+
+//Parse a size such as 32768, 32K or 1M
+bool parse_size(const std::string& s, size_t& value)
+{
+    char* end;
+    unsigned long long v = std::strtoull(s.c_str(), &end, 10);
+    if (end == s.c_str()) return false;
+    std::string suffix(end);
+    if (suffix == "K" || suffix == "k") v <<= 10;
+    else if (suffix == "M" || suffix == "m") v <<= 20;
+    else if (!suffix.empty()) return false;
+    value = static_cast<size_t>(v);
+    return true;
+}
+
+/**
+ * Parse a cache description "size:assoc:line[:lru|fifo|random]". The line
+ * size must be a power of two and size must hold a whole number of sets.
+ */
+bool parse_config(const std::string& name, const std::string& spec, CacheConfig& config)
+{
+    std::vector<std::string> fields;
+    std::stringstream ss(spec);
+    for (std::string field; std::getline(ss, field, ':'); ) fields.push_back(field);
+    if (fields.size() < 3 || fields.size() > 4) return false;
+
+    config.name = name;
+    config.policy = Policy::LRU;
+    if (!parse_size(fields[0], config.size) || !parse_size(fields[1], config.assoc) || !parse_size(fields[2], config.line))
+        return false;
+    if (fields.size() == 4)
+    {
+        if (fields[3] == "lru") config.policy = Policy::LRU;
+        else if (fields[3] == "fifo") config.policy = Policy::FIFO;
+        else if (fields[3] == "random") config.policy = Policy::Random;
+        else return false;
+    }
+    return config.assoc > 0 && config.line >= 4 && (config.line & (config.line - 1)) == 0 &&
+           config.size >= config.assoc * config.line && config.size % (config.assoc * config.line) == 0;
+}
+
+/**
+ * One set-associative, write-back, write-allocate cache.
+ */
+class Cache
+{
+public:
+    explicit Cache(const CacheConfig& config)
+        : config(config), sets(config.size / (config.assoc * config.line)),
+          lines(sets * config.assoc)
+    {
+        while ((size_t(1) << line_bits) < config.line) line_bits++;
+    }
+
+    /**
+     * Look up the line holding addr and bring it in on a miss. Returns
+     * true on a hit. If a dirty line had to make room, its address is
+     * stored in writeback and dirty_evicted is set.
+     */
+    bool access(uint64_t addr, bool write, bool& dirty_evicted, uint64_t& writeback)
+    {
+        uint64_t block = addr >> line_bits;
+        Line* set = &lines[(block % sets) * config.assoc];
+        accesses++;
+        clock++;
+        dirty_evicted = false;
+
+        for (size_t w = 0; w < config.assoc; w++)
+        {
+            if (set[w].valid && set[w].block == block)
+            {
+                hits++;
+                if (config.policy == Policy::LRU) set[w].stamp = clock;
+                set[w].dirty |= write;
+                return true;
+            }
+        }
+
+        // An empty way if the set has one; otherwise the policy picks.
+        Line* victim = nullptr;
+        for (size_t w = 0; w < config.assoc && !victim; w++)
+        {
+            if (!set[w].valid) victim = &set[w];
+        }
+        if (!victim && config.policy == Policy::Random)
+        {
+            rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+            victim = &set[rng % config.assoc];
+        }
+        else if (!victim)
+        {
+            victim = set;
+            for (size_t w = 1; w < config.assoc; w++)
+            {
+                if (set[w].stamp < victim->stamp) victim = &set[w];
+            }
+        }
+        if (victim->valid && victim->dirty)
+        {
+            dirty_evicted = true;
+            writeback = victim->block << line_bits;
+        }
+        *victim = Line {block, clock, true, write};
+        return false;
+    }
+
+    CacheConfig config;
+    uint64_t accesses = 0;
+    uint64_t hits = 0;
+
+private:
+    struct Line
+    {
+        uint64_t block;
+        uint64_t stamp;  // last use (LRU) or fill time (FIFO)
+        bool valid;
+        bool dirty;
+    };
+
+    size_t sets;
+    std::vector<Line> lines;
+    unsigned line_bits = 0;
+    uint64_t clock = 0;
+    uint64_t rng = 0x9E3779B97F4A7C15ULL;
+};
+
+/**
+ * Split L1 instruction and data caches in front of zero or more unified
+ * levels. Text and data are separate address spaces, so text addresses are
+ * moved above 4 GiB before they reach a unified level.
+ */
+class Hierarchy
+{
+public:
+    Hierarchy(const CacheConfig& l1i, const CacheConfig& l1d, const std::vector<CacheConfig>& lower_configs)
+        : l1i(l1i), l1d(l1d)
+    {
+        for (const CacheConfig& c : lower_configs) lower.emplace_back(c);
+    }
+
+    //Returns the level that hit: 0 for L1, 1 for the first unified level, ..., levels() for memory
+    size_t access(bool instruction, uint32_t address, bool write)
+    {
+        uint64_t addr = instruction ? (uint64_t(1) << 32) | address : address;
+        bool dirty;
+        uint64_t evicted;
+        Cache& l1 = instruction ? l1i : l1d;
+        if (l1.access(addr, write, dirty, evicted)) return 0;
+        if (dirty) write_back(0, evicted);
+        for (size_t k = 0; k < lower.size(); k++)
+        {
+            if (lower[k].access(addr, false, dirty, evicted)) return k + 1;
+            if (dirty) write_back(k + 1, evicted);
+        }
+        return lower.size() + 1;
+    }
+
+    size_t levels() const { return lower.size() + 1; }
+
+    Cache l1i, l1d;
+    std::vector<Cache> lower;
+
+private:
+    //Write a dirty line evicted from level k into level k + 1
+    void write_back(size_t k, uint64_t addr)
+    {
+        if (k >= lower.size()) return;
+        bool dirty;
+        uint64_t evicted;
+        lower[k].access(addr, true, dirty, evicted);
+        if (dirty) write_back(k + 1, evicted);
+    }
+};
+
+/**
+ * Misses counted for one instruction or one data label. An access "misses"
+ * when L1 misses; it reaches memory when every level misses.
+ */
+struct Counters
+{
+    uint64_t fetches = 0;
+    uint64_t fetch_misses = 0;
+    uint64_t data = 0;          // loads and stores
+    uint64_t data_misses = 0;
+    uint64_t memory = 0;        // accesses that missed every level
+
+    void add(const Counters& c)
+    {
+        fetches += c.fetches; fetch_misses += c.fetch_misses;
+        data += c.data; data_misses += c.data_misses; memory += c.memory;
+    }
+};
+
+struct Label
+{
+    uint32_t address;
+    std::string name;
+};
+
+//Index of the last label at or below address, or -1 if there is none
+long find_label(const std::vector<Label>& labels, uint32_t address)
+{
+    auto it = std::upper_bound(labels.begin(), labels.end(), address,
+                               [](uint32_t a, const Label& l) { return a < l.address; });
+    return static_cast<long>(it - labels.begin()) - 1;
+}
+
+/**
+ * The Machine trace that drives the hierarchy. Counters are kept per
+ * instruction and per data label and only summed up at the end.
+ */
+struct CacheTrace
+{
+    Hierarchy& caches;
+    std::vector<Counters>& per_pc;
+    const std::vector<Label>& data_labels;
+    std::vector<Counters>& per_data_label;
+    size_t static_bytes;  // data labels only cover static memory, not the stack
+
+    void fetch(uint32_t pc)
+    {
+        if (pc / 4 >= per_pc.size()) return;
+        Counters& c = per_pc[pc / 4];
+        size_t level = caches.access(true, pc, false);
+        c.fetches++;
+        c.fetch_misses += level > 0;
+        c.memory += level == caches.levels();
+    }
+
+    void data(uint32_t pc, uint32_t address, bool write)
+    {
+        size_t level = caches.access(false, address, write);
+        Counters& c = per_pc[pc / 4];
+        c.data++;
+        c.data_misses += level > 0;
+        c.memory += level == caches.levels();
+        long label = address < static_bytes ? find_label(data_labels, address) : -1;
+        if (label >= 0)
+        {
+            Counters& d = per_data_label[label];
+            d.data++;
+            d.data_misses += level > 0;
+            d.memory += level == caches.levels();
+        }
+    }
+
+    void load(uint32_t pc, uint32_t address) { data(pc, address, false); }
+    void store(uint32_t pc, uint32_t address) { data(pc, address, true); }
+};
+
+double percent(uint64_t part, uint64_t whole)
+{
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+void print_row(const std::string& name, const Counters& c)
+{
+    std::printf("  %-24s %12" PRIu64 " %7.2f%% %12" PRIu64 " %7.2f%% %12" PRIu64 "\n", name.c_str(),
+                c.fetches, percent(c.fetch_misses, c.fetches), c.data, percent(c.data_misses, c.data), c.memory);
+}
+
+void print_header(const char* title)
+{
+    std::printf("\n%s\n  %-24s %12s %8s %12s %8s %12s\n", title, "", "fetches", "L1I miss", "lw/sw", "L1D miss", "to memory");
+}
+
+int main(int argc, char* argv[])
+{
+    Endian endian = Endian::Little;
+    size_t memory_bytes = 16 << 20;
+    uint64_t max_instructions = 0;
+    size_t range = 256;
+    const char* map_path = nullptr;
+    std::string l1i_spec = "16K:2:32:lru", l1d_spec = "16K:4:32:lru", l2_spec = "256K:8:64:lru", l3_spec = "none";
+    std::vector<const char*> files;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "-EB") endian = Endian::Big;
+        else if (arg == "-EL") endian = Endian::Little;
+        else if (arg == "--memory" && has_value) memory_bytes = std::strtoull(argv[++i], nullptr, 0);
+        else if (arg == "--max" && has_value) max_instructions = std::strtoull(argv[++i], nullptr, 0);
+        else if (arg == "--range" && has_value) range = std::strtoull(argv[++i], nullptr, 0);
+        else if (arg == "--map" && has_value) map_path = argv[++i];
+        else if (arg == "--l1i" && has_value) l1i_spec = argv[++i];
+        else if (arg == "--l1d" && has_value) l1d_spec = argv[++i];
+        else if (arg == "--l2" && has_value) l2_spec = argv[++i];
+        else if (arg == "--l3" && has_value) l3_spec = argv[++i];
+        else files.push_back(argv[i]);
+    }
+
+    CacheConfig l1i, l1d, level;
+    std::vector<CacheConfig> lower;
+    bool ok = files.size() == 2 && range >= 4 && memory_bytes >= 4 && memory_bytes <= 0xFFFFFFF0u &&
+              parse_config("L1I", l1i_spec, l1i) && parse_config("L1D", l1d_spec, l1d);
+    if (ok && l2_spec != "none")
+    {
+        ok = parse_config("L2", l2_spec, level);
+        lower.push_back(level);
+    }
+    if (ok && l3_spec != "none")
+    {
+        ok = !lower.empty() && parse_config("L3", l3_spec, level);
+        lower.push_back(level);
+    }
+    if (!ok)
+    {
+        std::cerr
+            << "Expected Usage:\n"
+            << "  ./cachesim [options] staticmem_file.bin instructions_file.bin\n"
+            << "  --l1i spec      L1 instruction cache (default 16K:2:32:lru)\n"
+            << "  --l1d spec      L1 data cache (default 16K:4:32:lru)\n"
+            << "  --l2 spec|none  unified L2 (default 256K:8:64:lru)\n"
+            << "  --l3 spec|none  unified L3 (default none)\n"
+            << "  --map file      symbol map from assemble --map, for per-label results\n"
+            << "  --range bytes   size of the pc ranges to report (default 256)\n"
+            << "  --memory bytes  size of data memory (default 16 MiB)\n"
+            << "  --max n         stop after n instructions\n"
+            << "  -EL|-EB         byte order of the input files (default -EL)\n"
+            << "A spec is size:assoc:line[:lru|fifo|random], e.g. 32K:8:64:lru.\n";
+        exit(1);
+    }
+
+    std::vector<uint32_t> static_memory, text;
+    if (!read_words(files[0], endian, static_memory) || !read_words(files[1], endian, text))
+    {
+        std::cerr << "Error: could not read input files" << std::endl;
+        exit(1);
+    }
+    if (static_memory.size() * 4 > memory_bytes)
+    {
+        std::cerr << "Error: static memory does not fit in " << memory_bytes << " bytes" << std::endl;
+        exit(1);
+    }
+
+    std::vector<Label> text_labels, data_labels;
+    if (map_path)
+    {
+        std::ifstream map(map_path);
+        if (!map)
+        {
+            std::cerr << "Error: could not open symbol map: " << map_path << std::endl;
+            exit(1);
+        }
+        std::string section, name;
+        uint32_t address;
+        while (map >> section >> address >> name)
+        {
+            (section == "text" ? text_labels : data_labels).push_back({address, name});
+        }
+    }
+
+    Hierarchy caches(l1i, l1d, lower);
+    std::vector<Counters> per_pc(text.size());
+    std::vector<Counters> per_data_label(data_labels.size());
+    CacheTrace trace {caches, per_pc, data_labels, per_data_label, static_memory.size() * 4};
+
+    Machine machine(text, static_memory, memory_bytes);
+    RunResult result = machine.run(trace, max_instructions);
+    std::cout.flush();
+    if (result.status == RunResult::Error)
+    {
+        std::cerr << "Error: " << result.error << std::endl;
+    }
+
+    std::printf("%" PRIu64 " instructions in %.3f s\n", result.instructions, result.seconds);
+    std::printf("\n  %-6s %-22s %14s %14s %14s %8s\n", "level", "config", "accesses", "hits", "misses", "miss");
+    std::vector<const Cache*> all = {&caches.l1i, &caches.l1d};
+    for (const Cache& c : caches.lower) all.push_back(&c);
+    for (const Cache* c : all)
+    {
+        const CacheConfig& cfg = c->config;
+        const char* policy = cfg.policy == Policy::LRU ? "lru" : cfg.policy == Policy::FIFO ? "fifo" : "random";
+        std::string desc = std::to_string(cfg.size) + ":" + std::to_string(cfg.assoc) + ":" +
+                           std::to_string(cfg.line) + ":" + policy;
+        std::printf("  %-6s %-22s %14" PRIu64 " %14" PRIu64 " %14" PRIu64 " %7.2f%%\n", cfg.name.c_str(), desc.c_str(),
+                    c->accesses, c->hits, c->accesses - c->hits, percent(c->accesses - c->hits, c->accesses));
+    }
+
+    if (!text_labels.empty())
+    {
+        std::vector<Counters> per_label(text_labels.size());
+        Counters unlabeled;
+        for (size_t i = 0; i < per_pc.size(); i++)
+        {
+            long label = find_label(text_labels, static_cast<uint32_t>(i * 4));
+            (label >= 0 ? per_label[label] : unlabeled).add(per_pc[i]);
+        }
+        print_header("By text label (code from each label to the next):");
+        if (unlabeled.fetches) print_row("(before first label)", unlabeled);
+        for (size_t i = 0; i < text_labels.size(); i++)
+        {
+            if (per_label[i].fetches) print_row(text_labels[i].name, per_label[i]);
+        }
+    }
+
+    print_header("By pc range:");
+    for (size_t start = 0; start < per_pc.size() * 4; start += range)
+    {
+        Counters c;
+        for (size_t pc = start; pc < start + range && pc / 4 < per_pc.size(); pc += 4) c.add(per_pc[pc / 4]);
+        if (!c.fetches) continue;
+        char name[2 * 16 + 2]; // two 64-bit addresses in hex and a dash
+        std::snprintf(name, sizeof(name), "%08zx-%08zx", start, start + range - 1);
+        print_row(name, c);
+    }
+
+    if (!data_labels.empty())
+    {
+        print_header("By data label (lw/sw addresses from each label to the next):");
+        for (size_t i = 0; i < data_labels.size(); i++)
+        {
+            if (per_data_label[i].data) print_row(data_labels[i].name, per_data_label[i]);
+        }
+    }
+
+    return result.status == RunResult::Error ? 1 : 0;
+}
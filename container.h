@@ -0,0 +1,213 @@
+#ifndef __CONTAINER_H__
+#define __CONTAINER_H__
+
+#include "project1.h"
+
+#include <cstddef>
+
+/**
+ * Program container
+ *
+ * The alternative to the two headerless output files is a single file.
+ * It holds the text, static memory, exported symbols and a map from
+ * instructions back to source lines. Every field is a 32-bit word in the
+ * byte order the header names, apart from the magic and the string pool.
+ * Every section starts on a 4-byte boundary and every table is made of
+ * fixed-size records, so a loader can mmap the file and index straight
+ * into it:
+ *
+ *   header       ContainerHeader
+ *   directory    one ContainerSection per section, at directory_offset
+ *   Text         instruction words, as in the instructions file
+ *   Data         static memory bytes, as in the static memory file
+ *   Symbols      ContainerSymbol records, sorted by section and address
+ *   SymbolIndex  open-addressing table of symbol numbers, found by hash
+ *   Strings      symbol and file names, each followed by a NUL
+ *   Files        ContainerFile records, one per source file
+ *   Lines        ContainerLine records, sorted by word
+ *
+ * Sections may appear in any order; the directory says where each is.
+ */
+constexpr char CONTAINER_MAGIC[8] = {'M', 'I', 'P', 'S', 'P', 'R', 'O', 'G'};
+constexpr uint32_t CONTAINER_VERSION = 1;
+constexpr uint32_t CONTAINER_BYTE_ORDER_MARK = 0x01020304;
+constexpr uint32_t CONTAINER_EMPTY_SLOT = 0xFFFFFFFF;
+
+enum class SectionKind : uint32_t { Text = 1, Data, Symbols, SymbolIndex, Strings, Files, Lines };
+constexpr uint32_t CONTAINER_SECTIONS = 7;
+
+struct ContainerHeader {
+    char magic[8];
+    uint32_t byte_order_mark;    // CONTAINER_BYTE_ORDER_MARK as written
+    uint32_t version;
+    uint32_t endian;             // 0 little, 1 big
+    uint32_t section_count;
+    uint32_t directory_offset;   // bytes from the start of the file
+    uint32_t reserved;
+};
+
+struct ContainerSection {
+    uint32_t kind;               // SectionKind
+    uint32_t offset;             // bytes from the start of the file
+    uint32_t size;               // bytes
+    uint32_t count;              // records (words for Text, bytes for Data and Strings)
+};
+
+struct ContainerSymbol {
+    uint32_t name;               // offset in the string pool
+    uint32_t name_length;
+    uint32_t hash;               // low 32 bits of hash_bytes(name)
+    uint32_t section;            // Section::Text or Section::Data
+    uint32_t address;            // byte address in its section
+};
+
+struct ContainerFile {
+    uint32_t name;               // offset in the string pool
+    uint32_t name_length;
+};
+
+// Words from `word` up to the next record came from this line.
+struct ContainerLine {
+    uint32_t word;               // text word index
+    uint32_t file;               // index into Files
+    uint32_t line;               // 1-based
+};
+
+static_assert(sizeof(ContainerHeader) == 32 && sizeof(ContainerSection) == 16 && sizeof(ContainerSymbol) == 20 &&
+              sizeof(ContainerFile) == 8 && sizeof(ContainerLine) == 12, "container records must be packed words");
+
+//Whether bytes start like a container, in either byte order
+inline bool is_container(std::string_view bytes) {
+    return bytes.size() >= sizeof(ContainerHeader) && memcmp(bytes.data(), CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC)) == 0;
+}
+
+/**
+ * Read-only view of a container held in memory (usually a MappedFile).
+ * Nothing is copied: records are read from the bytes when asked for.
+ * ok() is false if the header or directory is damaged or from another
+ * version, or a section does not fit in the file.
+ */
+class ContainerView {
+public:
+    struct SymbolRecord {
+        std::string_view name;
+        Section section;
+        uint32_t address;
+    };
+    struct LineRecord {
+        std::string_view file;
+        uint32_t line;
+    };
+
+    explicit ContainerView(std::string_view bytes) : bytes(bytes) {
+        if (!is_container(bytes)) return;
+        uint32_t mark;
+        memcpy(&mark, bytes.data() + offsetof(ContainerHeader, byte_order_mark), 4);
+        if (mark != CONTAINER_BYTE_ORDER_MARK && mark != __builtin_bswap32(CONTAINER_BYTE_ORDER_MARK)) return;
+        swap = mark != CONTAINER_BYTE_ORDER_MARK;
+        if (field(offsetof(ContainerHeader, version)) != CONTAINER_VERSION) return;
+        uint32_t endian = field(offsetof(ContainerHeader, endian));
+        if (endian > 1 || (endian == 1) != ((host_endian() == Endian::Big) != swap)) return;
+        byte_order = endian ? Endian::Big : Endian::Little;
+
+        uint32_t count = field(offsetof(ContainerHeader, section_count));
+        uint64_t directory = field(offsetof(ContainerHeader, directory_offset));
+        if (directory % 4 || directory + uint64_t(count) * sizeof(ContainerSection) > bytes.size()) return;
+        for (uint32_t s = 0; s < count; s++) {
+            size_t at = directory + s * sizeof(ContainerSection);
+            uint32_t kind = field(at), offset = field(at + 4), size = field(at + 8);
+            if (offset % 4 || uint64_t(offset) + size > bytes.size()) return;
+            if (kind >= 1 && kind <= CONTAINER_SECTIONS) {
+                sections[kind - 1] = bytes.substr(offset, size);
+                counts[kind - 1] = field(at + 12);
+            }
+        }
+        valid = counts_fit(SectionKind::Text, 4) && counts_fit(SectionKind::Data, 1) &&
+                counts_fit(SectionKind::Symbols, sizeof(ContainerSymbol)) &&
+                counts_fit(SectionKind::SymbolIndex, 4) && counts_fit(SectionKind::Strings, 1) &&
+                counts_fit(SectionKind::Files, sizeof(ContainerFile)) &&
+                counts_fit(SectionKind::Lines, sizeof(ContainerLine));
+        uint32_t slots = count_of(SectionKind::SymbolIndex);
+        valid = valid && (slots & (slots - 1)) == 0 && (slots > count_of(SectionKind::Symbols) || slots == 0);
+    }
+
+    bool ok() const { return valid; }
+    Endian endian() const { return byte_order; }
+
+    //The bytes of a section, empty if the container has none
+    std::string_view section(SectionKind kind) const { return sections[static_cast<uint32_t>(kind) - 1]; }
+    uint32_t count_of(SectionKind kind) const { return counts[static_cast<uint32_t>(kind) - 1]; }
+
+    uint32_t text_word(size_t index) const { return word(SectionKind::Text, index); }
+    size_t symbol_count() const { return count_of(SectionKind::Symbols); }
+
+    SymbolRecord symbol(size_t index) const {
+        size_t at = index * sizeof(ContainerSymbol);
+        uint32_t section = word(SectionKind::Symbols, at / 4 + 3);
+        return {string(word(SectionKind::Symbols, at / 4), word(SectionKind::Symbols, at / 4 + 1)),
+                section <= static_cast<uint32_t>(Section::Data) ? static_cast<Section>(section) : Section::None,
+                word(SectionKind::Symbols, at / 4 + 4)};
+    }
+
+    //Number of the symbol called name, or -1; probes the index the way SymbolTable does
+    long find_symbol(std::string_view name) const {
+        uint32_t slots = count_of(SectionKind::SymbolIndex);
+        if (slots == 0) return -1;
+        uint32_t hash = static_cast<uint32_t>(hash_bytes(name));
+        for (uint32_t slot = hash & (slots - 1), probes = 0; probes < slots; slot = (slot + 1) & (slots - 1), probes++) {
+            uint32_t id = word(SectionKind::SymbolIndex, slot);
+            if (id == CONTAINER_EMPTY_SLOT || id >= symbol_count()) return -1;
+            if (word(SectionKind::Symbols, id * 5 + 2) == hash && symbol(id).name == name) return id;
+        }
+        return -1;
+    }
+
+    //Source file and line of a text word, found by binary search of the line map
+    bool line_of(uint32_t text_index, LineRecord &record) const {
+        size_t lo = 0, hi = count_of(SectionKind::Lines);
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (word(SectionKind::Lines, mid * 3) <= text_index) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo == 0) return false;
+        uint32_t file = word(SectionKind::Lines, (lo - 1) * 3 + 1);
+        if (file >= count_of(SectionKind::Files)) return false;
+        record.file = string(word(SectionKind::Files, file * 2), word(SectionKind::Files, file * 2 + 1));
+        record.line = word(SectionKind::Lines, (lo - 1) * 3 + 2);
+        return true;
+    }
+
+private:
+    uint32_t field(size_t offset) const {
+        uint32_t value;
+        memcpy(&value, bytes.data() + offset, 4);
+        return swap ? __builtin_bswap32(value) : value;
+    }
+
+    //Word index of a section, or 0 past its end
+    uint32_t word(SectionKind kind, size_t index) const {
+        std::string_view s = section(kind);
+        if (index >= s.size() / 4) return 0;
+        return field(static_cast<size_t>(s.data() - bytes.data()) + 4 * index);
+    }
+
+    std::string_view string(uint32_t offset, uint32_t length) const {
+        std::string_view pool = section(SectionKind::Strings);
+        if (offset > pool.size() || length > pool.size() - offset) return std::string_view();
+        return pool.substr(offset, length);
+    }
+
+    bool counts_fit(SectionKind kind, size_t record) const {
+        return uint64_t(count_of(kind)) * record <= section(kind).size();
+    }
+
+    std::string_view bytes;
+    std::string_view sections[CONTAINER_SECTIONS];
+    uint32_t counts[CONTAINER_SECTIONS] = {};
+    Endian byte_order = Endian::Little;
+    bool swap = false;
+    bool valid = false;
+};
+
+#endif
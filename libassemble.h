@@ -0,0 +1,78 @@
+#ifndef __LIBASSEMBLE_H__
+#define __LIBASSEMBLE_H__
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * In-process assembler (libassemble.a, built by "make libassemble.a")
+ *
+ * The assembler without its command line: source text goes in from
+ * memory, and the instruction and static memory words come back in
+ * vectors, so a tool that generates, assembles and runs programs needs no
+ * temporary files and no child process. Problems come back as
+ * AssemblerError records rather than messages on stderr, and a label that
+ * nothing defines is one of them. Link with -pthread. The words are what the simulator loads: Machine takes
+ * AssemblerOutput::instructions and static_memory as they are.
+ */
+struct AssemblerSource {
+    std::string name;       // names the source in errors, like a file name
+    std::string_view text;  // must stay valid until assemble returns
+};
+
+struct AssemblerError {
+    std::string file;       // the source's name, empty if the error is not in a source
+    int line;               // 1-based, 0 if the error is about the whole source
+    std::string message;
+};
+
+struct AssemblerOptions {
+    bool big_endian = false;  // -EB: byte order of static memory words
+    bool optimize = false;    // -O
+    bool schedule = false;    // --schedule
+    std::string_view profile; // --profile: text of a profile, empty for none; must outlive the Assembler.
+                              // Its "file:label" lines name files as AssemblerSource::name does.
+    unsigned threads = 1;     // -jN
+};
+
+struct AssemblerOutput {
+    std::vector<uint32_t> instructions;
+    std::vector<uint32_t> static_memory;
+    std::vector<AssemblerError> errors;  // the words are empty if there are any
+
+    bool ok() const { return errors.empty(); }
+};
+
+/**
+ * Assembles program after program, like one --batch worker: objects and
+ * buffers are kept between calls, and the vectors of an output passed in
+ * again keep their capacity. One Assembler must not be used from two
+ * threads at once; separate ones may.
+ */
+class Assembler {
+public:
+    explicit Assembler(const AssemblerOptions &options = AssemblerOptions());
+    ~Assembler();
+    Assembler(const Assembler &) = delete;
+    Assembler &operator=(const Assembler &) = delete;
+
+    //Assemble and link sources as one program; returns output.ok()
+    bool assemble(const std::vector<AssemblerSource> &sources, AssemblerOutput &output);
+
+private:
+    struct State;
+    AssemblerOptions options;
+    std::unique_ptr<State> state;
+};
+
+//Assemble one program with a fresh Assembler
+AssemblerOutput assemble_program(const std::vector<AssemblerSource> &sources,
+                                 const AssemblerOptions &options = AssemblerOptions());
+
+//An error as assemble prints it: "file:line: error: message"
+std::string format_error(const AssemblerError &error);
+
+#endif
@@ -3,491 +3,3299 @@
 #define DEBUG false
 
 #include "project1.h"
+#include "container.h"
+#include "libassemble.h"
 
 #include <vector>
 #include <string>
 #include <unordered_map>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <thread>
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Everything but the in-process API and main is private to this file, so
+// the library does not clash with the programs it is linked into.
+namespace
+{
+
+/**
+ * A label use whose field is filled in at link time, once every word has
+ * its final address. The word is stored with its label field zeroed.
+ */
+enum class FixupKind { Branch, Jump, AddressHi, AddressLo, Word };
+
+struct Fixup
+{
+    FixupKind kind;
+    int word;          // text word to patch; for Word, where the data word is stored in data.stored()
+    int symbol;        // id in the file's symbol table
+};
+
+/**
+ * A problem found in a source line. Files are assembled on worker threads,
+ * so problems are collected with the object and reported afterwards.
+ */
+struct Diagnostic
+{
+    int line;
+    std::string message;
+};
 
 /**
- * Parse a single .data line that may contain a ".word" directive.
- * Extracts comma/whitespace–separated tokens after ".word" and appends each
- * resolved value into static_memory. For each appended word, advances
- * static_memory_address by 4 bytes.
+ * Static memory of one file, in the output byte order. The contents are a
+ * list of runs, each a pattern of stored bytes repeated to fill the run:
+ * a literal run's pattern is the whole run, .space is one zero byte and
+ * "value : count" is the value. Large zero-filled or repeated regions cost
+ * one run, not their size.
  */
-void get_static_memory(std::string line, int& static_memory_address, std::vector<int>& static_memory, const std::unordered_map<std::string, int>& text_label_map, const std::unordered_map<std::string, int>& data_label_map) 
+class DataImage
 {
-    // Normalize tabs to spaces for simpler scanning.
-    for (char& c : line) 
+public:
+    struct Run
     {
-        if (c == '\t') c = ' ';
-    }
-    // Find the ".word" directive on this line; return if missing.
-    std::size_t pos = line.find(".word");
-    if (pos == std::string::npos) return;
-    pos += 5;
-    std::string token;
+        uint32_t offset; // first byte of the run in the image
+        uint32_t length; // bytes in the run
+        uint32_t source; // first pattern byte in stored()
+        uint32_t period; // pattern length; equal to length for a literal run
+    };
+
+    static constexpr uint32_t MAX_BYTES = 0x7FFFFFFF;
 
-    // Process an accumulated token: resolve to an int, push to static_memory,
-    auto flush = [&](const std::string& t) 
+    void clear(Endian byte_order)
     {
-        if (t.empty()) return;
+        endian = byte_order;
+        bytes.clear();
+        runs.clear();
+        total = 0;
+        largest_alignment = 1;
+    }
 
-        // Try to parse as integer.
-        try 
+    // Append the low `size` bytes of value; returns where they are stored.
+    uint32_t append(uint32_t value, uint32_t size)
+    {
+        uint32_t source = static_cast<uint32_t>(bytes.size());
+        store(value, size);
+        if (!runs.empty() && runs.back().period == runs.back().length &&
+            runs.back().source + runs.back().length == source)
         {
-            int v = std::stoi(t);
-            static_memory.push_back(v);
-        } catch (...) 
+            runs.back().length += size;
+            runs.back().period += size;
+        } else
+        {
+            runs.push_back({total, size, source, size});
+        }
+        total += size;
+        return source;
+    }
+
+    // Append count copies of the low `size` bytes of value; returns where the pattern is stored.
+    uint32_t repeat(uint32_t value, uint32_t size, uint32_t count)
+    {
+        uint32_t source = static_cast<uint32_t>(bytes.size());
+        if (count == 0) return source;
+        store(value, size);
+        runs.push_back({total, size * count, source, size});
+        total += size * count;
+        return source;
+    }
+
+    void align(uint32_t alignment)
+    {
+        largest_alignment = std::max(largest_alignment, alignment);
+        uint32_t padding = (alignment - total % alignment) % alignment;
+        if (padding) repeat(0, 1, padding);
+    }
+
+    // Overwrite a stored word, e.g. a .word whose label is now known.
+    void patch(uint32_t source, uint32_t value)
+    {
+        for (uint32_t i = 0; i < 4; i++) bytes[source + i] = byte(value, i, 4);
+    }
+
+    /**
+     * Append another image as if its contents had been added here. Its
+     * padding was worked out from offset 0, so this is only the same if
+     * the current size is a multiple of every alignment it asked for;
+     * returns false, appending nothing, otherwise.
+     */
+    bool append_image(const DataImage& other)
+    {
+        if (total % other.largest_alignment != 0) return false;
+        uint32_t source_base = static_cast<uint32_t>(bytes.size());
+        bytes.insert(bytes.end(), other.bytes.begin(), other.bytes.end());
+        for (const Run& run : other.runs)
         {
-            // If is not a number then try data label.
-            auto d = data_label_map.find(t);
-            if (d != data_label_map.end()) 
+            if (!runs.empty() && run.period == run.length && runs.back().period == runs.back().length &&
+                runs.back().source + runs.back().length == source_base + run.source)
             {
-                static_memory.push_back(d->second);
-            } else 
+                runs.back().length += run.length;
+                runs.back().period += run.length;
+            } else
             {
-                // Else try text label and convert instruction index to byte address.
-                auto it = text_label_map.find(t);
-                if (it != text_label_map.end()) 
-                {
-                    static_memory.push_back(it->second * 4);
-                } else 
-                {
-                    static_memory.push_back(0);
-                }
+                runs.push_back({total + run.offset, run.length, source_base + run.source, run.period});
             }
         }
+        total += other.total;
+        largest_alignment = std::max(largest_alignment, other.largest_alignment);
+        return true;
+    }
 
-        static_memory_address += 4;
-    };
+    uint32_t size() const { return total; }
+    Endian byte_order() const { return endian; }
+    const std::vector<uint8_t>& stored() const { return bytes; }
+    const std::vector<Run>& run_list() const { return runs; }
 
-    // Scan the remainder of the line; split by commas and whitespace.
-    for (std::size_t i = pos; i <= line.size(); ++i) 
+    // Rebuild an image from its parts (for the cache); returns false if they do not fit together.
+    bool restore(Endian byte_order, std::vector<uint8_t> stored_bytes, std::vector<Run> run_list)
     {
-        char ch = (i < line.size() ? line[i] : ',');
-        if (ch == ',' || std::isspace(static_cast<unsigned char>(ch)) || i == line.size()) 
-        {
-            if (!token.empty()) 
-            { flush(token); token.clear(); }
-        } else 
+        endian = byte_order;
+        bytes = std::move(stored_bytes);
+        runs = std::move(run_list);
+        total = 0;
+        for (const Run& run : runs)
         {
-            token.push_back(ch);
+            if (run.offset != total || run.period == 0 || run.length % run.period != 0 ||
+                run.source > bytes.size() || run.period > bytes.size() - run.source || run.length > MAX_BYTES - total)
+            {
+                return false;
+            }
+            total += run.length;
         }
+        return true;
     }
+
+private:
+    // Byte i (in memory order) of a size-byte value.
+    uint8_t byte(uint32_t value, uint32_t i, uint32_t size) const
+    {
+        return static_cast<uint8_t>(value >> (8 * (endian == Endian::Little ? i : size - 1 - i)));
+    }
+
+    void store(uint32_t value, uint32_t size)
+    {
+        for (uint32_t i = 0; i < size; i++) bytes.push_back(byte(value, i, size));
+    }
+
+    std::vector<uint8_t> bytes; // literal bytes and patterns, in order of appearance
+    std::vector<Run> runs;
+    uint32_t total = 0;
+    uint32_t largest_alignment = 1; // of any align() since clear()
+    Endian endian = Endian::Little;
+};
+
+/**
+ * The first text word of a source line that produced any, for the line
+ * map of a container.
+ */
+struct LineStart
+{
+    int word;
+    int line;
+};
+
+/**
+ * Relocatable result of assembling one input file. Text labels are word
+ * indices from the start of this file's text and data labels byte offsets
+ * from the start of its data; the link step moves both into place.
+ */
+struct ObjectFile
+{
+    std::vector<int> text;                               // encoded instruction words
+    DataImage data;                                      // static memory
+    SymbolTable symbols;                                 // every label defined, used or .globl'd here
+    std::vector<Fixup> relocations;                      // label uses left for the link step
+    std::vector<LineStart> line_starts;                  // in text order
+    int main_word = -1;                                  // where "main:" is, if this file has it
+    int lines = 0;                                       // source lines read
+    std::array<int, static_cast<std::size_t>(Op::count)> op_counts {}; // uses of each mnemonic
+    std::array<int, static_cast<std::size_t>(Op::count)> op_words {};  // words those uses emitted
+    std::vector<Diagnostic> diagnostics;                 // never cached: such objects are not linked
+};
+
+/**
+ * Everything the assembler remembers between lines of one file.
+ */
+struct AssemblerState
+{
+    ObjectFile& object;
+    Endian endian;                      // byte order of static memory
+    InstructionFields fields {};        // text so far, encoded into object.text at the end of the file
+    bool reading_static_memory = false;
+    int line = 0; // 1-based number of the line being assembled
+};
+
+void report(AssemblerState& state, std::string message)
+{
+    state.object.diagnostics.push_back({state.line, std::move(message)});
 }
 
 /**
- * Build a map of text labels to instruction indices.
- * Counts only real instructions.
+ * Bind a label of this file to a place in the given section.
  */
-std::unordered_map<std::string, int> match_labels(std::vector<std::string> instructions) 
+void define_label(AssemblerState& state, std::string_view name, Section section, int value)
 {
-    std::unordered_map<std::string, int> label_map;
-    bool main_found = false;
-    int line_number = 0;
+    Symbol& symbol = state.object.symbols[state.object.symbols.intern(name)];
+    if (symbol.defined()) report(state, "label defined twice: " + std::string(name));
+    symbol.section = section;
+    symbol.value = value;
+}
 
-    for (const std::string& inst : instructions) 
-    {
-        if (!main_found) 
-        {
-            if (inst == "main:") main_found = true;
-            continue;
-        }
+/**
+ * Where a label points, once its file is placed.
+ */
+struct LabelValue
+{
+    bool in_text = false;
+    bool in_data = false;
+    int text = 0; // word address
+    int data = 0; // byte address
+};
+
+LabelValue label_value(const Symbol& symbol, int text_base, int data_base)
+{
+    LabelValue value;
+    if (symbol.section == Section::Text)
+    { value.in_text = true; value.text = symbol.value + text_base; }
+    if (symbol.section == Section::Data)
+    { value.in_data = true; value.data = symbol.value + data_base; }
+    return value;
+}
 
-        // Skip assembler directives like .data/.text/.globl.
-        if (inst.empty() || inst[0] == '.') continue;
+/**
+ * Compute the label field of a fixup's word, which sits at word address
+ * `address`. Branches hold an offset in words, jumps a word address, la and
+ * .word a byte address (text labels first for la, data labels first for
+ * .word). Returns whether the label is defined for this use; if it is not,
+ * the field is 0 and link() reports the use as an error.
+ */
+bool label_field(FixupKind kind, const LabelValue& value, int address, int& field)
+{
+    bool found = true;
+    int addr = 0;
 
-        // Label-only line: "label:"
-        if (!inst.empty() && inst.back() == ':') 
-        {
-            std::string label = inst.substr(0, inst.size() - 1);
-            label_map[label] = line_number;
-            continue;
-        }
-        line_number++;
+    switch (kind)
+    {
+        case FixupKind::Branch:
+        case FixupKind::Jump:
+            found = value.in_text;
+            addr = value.text;
+            break;
+        case FixupKind::AddressHi:
+        case FixupKind::AddressLo:
+            if (value.in_text)      addr = value.text * 4;
+            else if (value.in_data) addr = value.data;
+            else found = false;
+            break;
+        case FixupKind::Word:
+            if (value.in_data)      addr = value.data;
+            else if (value.in_text) addr = value.text * 4;
+            else found = false;
+            break;
+    }
+    if (!found)
+    {
+        field = 0;
+        return false;
     }
 
-    return label_map;
+    switch (kind)
+    {
+        case FixupKind::Branch:    field = (addr - (address + 1)) & 0xFFFF; break;
+        case FixupKind::Jump:      field = addr & 0x3FFFFFF; break;
+        case FixupKind::AddressHi: field = (addr >> 16) & 0xFFFF; break;
+        case FixupKind::AddressLo: field = addr & 0xFFFF; break;
+        case FixupKind::Word:      field = addr; break;
+    }
+    return true;
 }
 
 /**
- * Build a map of data labels to byte offsets.
- * Scans all lines and every ".word" count advances the current byte offset by 4 per entry.
+ * Record that the word just emitted refers to a label, as a relocation.
+ * Even branches within the file wait for link(): relaxing a far branch
+ * elsewhere can move their target.
  */
-std::unordered_map<std::string, int> add_data_labels(std::vector<std::string> instructions) 
+void emit_label_use(AssemblerState& state, FixupKind kind, std::string_view label)
 {
-    std::unordered_map<std::string, int> data_label_map;
-    int byte_offset = 0;
+    ObjectFile& object = state.object;
+    object.relocations.push_back({kind, static_cast<int>(state.fields.size()) - 1, object.symbols.intern(label)});
+}
 
-    for (std::string raw : instructions) 
+/**
+ * Split the operands of a data directive: values separated by commas or
+ * whitespace, ':' on its own, and "strings" (kept with their quotes).
+ * Returns false on an unterminated string.
+ */
+bool data_tokens(std::string_view s, std::vector<std::string_view>& tokens)
+{
+    tokens.clear();
+    for (std::size_t i = 0; i < s.size(); )
     {
-        for (char& c : raw) 
+        char c = s[i];
+        if (c == ',' || std::isspace(static_cast<unsigned char>(c))) { i++; continue; }
+        std::size_t start = i;
+        if (c == '"')
         {
-            if (c == '\t') c = ' ';
-        }
-        // If the line has a label at the start, capture it as pointing to current byte_offset.
-        std::size_t colon = raw.find(':');
-        if (colon != std::string::npos) 
-        {
-            std::string label = raw.substr(0, colon);
-            while (!label.empty() && std::isspace(static_cast<unsigned char>(label.back()))) 
-            {
-                label.pop_back();
-            }
-            if (!label.empty() && label[0] != '.') 
+            for (i++; i < s.size() && s[i] != '"'; i++)
             {
-                data_label_map[label] = byte_offset;
+                if (s[i] == '\\') i++;
             }
+            if (i >= s.size()) return false;
+            i++;
+        } else if (c == ':')
+        {
+            i++;
+        } else
+        {
+            while (i < s.size() && s[i] != ',' && s[i] != ':' && !std::isspace(static_cast<unsigned char>(s[i]))) i++;
         }
-        // If the line has ".word", count the number of entries to advance the offset.
-        std::size_t pos = raw.find(".word");
-        if (pos == std::string::npos) continue;
-        pos += 5;
+        tokens.push_back(s.substr(start, i - start));
+    }
+    return true;
+}
 
-        std::string tok;
-        int count_words = 0;
-        // Count tokens after ".word" separated by commas/whitespace.
-        for (std::size_t i = pos; i <= raw.size(); ++i) 
+// Decode the body of a quoted string, handling \n \t \r \0 \\ \" escapes.
+bool unescape(std::string_view quoted, std::string& out)
+{
+    out.clear();
+    for (std::size_t i = 1; i + 1 < quoted.size(); i++)
+    {
+        char c = quoted[i];
+        if (c == '\\')
         {
-            char ch = (i < raw.size() ? raw[i] : ',');
-            if (ch == ',' || std::isspace(static_cast<unsigned char>(ch)) || i == raw.size()) 
+            switch (quoted[++i])
             {
-                if (!tok.empty()) 
-                { ++count_words; tok.clear(); }
-            } else 
-            {
-                tok.push_back(ch);
+                case 'n':  c = '\n'; break;
+                case 't':  c = '\t'; break;
+                case 'r':  c = '\r'; break;
+                case '0':  c = '\0'; break;
+                case '\\': c = '\\'; break;
+                case '"':  c = '"'; break;
+                case '\'': c = '\''; break;
+                default:   return false;
             }
         }
-        byte_offset += 4 * count_words;
+        out += c;
     }
-
-    return data_label_map;
+    return true;
 }
 
-int main(int argc, char* argv[]) 
+/**
+ * Parse a single .data line: an optional "label:" followed by an optional
+ * directive. The label is bound to the address the directive's data
+ * starts at, after any alignment it implies.
+ *
+ *   .word v, ...    4-byte values (numbers or labels), aligned to 4
+ *   .half v, ...    2-byte numbers, aligned to 2
+ *   .byte v, ...    1-byte numbers
+ *   .space n        n zero bytes
+ *   .align n        align to 2^n bytes
+ *   .ascii "s"      the bytes of s; .asciiz adds a terminating zero
+ *
+ * For .word, .half and .byte, "v : n" stores v n times.
+ */
+void get_static_memory(std::string_view line, AssemblerState& state)
 {
-    if (argc < 4) 
+    DataImage& data = state.object.data;
+
+    // If the line has a label at the start, capture it.
+    std::string_view label;
+    std::size_t colon = line.find(':');
+    if (colon != std::string_view::npos && line[0] != '.' && is_label(rtrim(line.substr(0, colon))))
     {
-        std::cerr
-            << "Expected Usage:\n"
-            << "  ./assemble infile1.asm infile2.asm ... infilek.asm "
-            << "staticmem_outfile.bin instructions_outfile.bin\n";
-        exit(1);
+        label = rtrim(line.substr(0, colon));
+        line = ltrim(line.substr(colon + 1));
+    }
+    auto bind_label = [&]()
+    {
+        if (!label.empty()) define_label(state, label, Section::Data, static_cast<int>(data.size()));
+    };
+    if (line.empty())
+    {
+        bind_label();
+        return;
     }
 
-    // Prepare output files.
-    std::ofstream inst_outfile;
-    std::ofstream static_outfile;
-    static_outfile.open(argv[argc - 2], std::ios::binary);
-    inst_outfile.open(argv[argc - 1], std::ios::binary);
-
-    std::vector<std::string> instructions; // cleaned lines from all input files
-    std::vector<int> static_memory;        // assembled .data words
-
-    /**
-     * Phase 1:
-     * Read all instructions, clean them of comments and whitespace DONE
-     * TODO: Determine the numbers for all static memory labels
-     * (measured in bytes starting at 0)
-     * TODO: Determine the line numbers of all instruction line labels
-     * (measured in instructions) starting at 0
-    */
-    for (int i = 1; i < argc - 2; i++) 
-    {
-        std::ifstream infile(argv[i]);
-        if (!infile) 
-        {
-            std::cerr << "Error: could not open file: " << argv[i] << std::endl;
-            exit(1);
-        }
-
-        std::string line;
-        while (std::getline(infile, line)) 
-        {
-            line = clean(line);
-            if (line.empty()) continue;
-            instructions.push_back(line);
-        }
-        infile.close();
+    std::size_t name_end = std::min(line.find_first_of(WHITESPACE), line.size());
+    std::string_view directive = line.substr(0, name_end);
+    std::vector<std::string_view> tokens;
+    if (!data_tokens(line.substr(name_end), tokens))
+    {
+        report(state, "unterminated string");
+        return;
     }
 
-    // Build maps for labels.
-    std::unordered_map<std::string, int> label_map = match_labels(instructions);
-    if (DEBUG) 
+    uint32_t size = directive == ".word" ? 4 : directive == ".half" ? 2 : directive == ".byte" ? 1 : 0;
+    if (size)
     {
-        for (const auto& p : label_map) 
+        data.align(size);
+        bind_label();
+        int low = size == 4 ? INT32_MIN : size == 2 ? -32768 : -128;
+        int high = size == 4 ? INT32_MAX : size == 2 ? 65535 : 255;
+        for (std::size_t i = 0; i < tokens.size(); i++)
         {
-            std::cerr << "Label: " << p.first << "  Line: " << p.second << std::endl;
+            std::string_view t = tokens[i];
+            int count = 1;
+            if (i + 2 < tokens.size() && tokens[i + 1] == ":")
+            {
+                if (!parse_immediate(tokens[i + 2], count) || count < 0)
+                {
+                    report(state, "bad repeat count: " + std::string(tokens[i + 2]));
+                    count = 0;
+                }
+                i += 2;
+            }
+            if (static_cast<uint64_t>(count) * size > DataImage::MAX_BYTES - data.size())
+            {
+                report(state, "static memory is too large");
+                return;
+            }
+
+            // A number, or for .word a data or text label.
+            int v;
+            bool label_value = false;
+            if (parse_immediate(t, v))
+            {
+                if (size < 4 && (v < low || v > high)) report(state, "value out of range: " + std::string(t));
+            } else if (size == 4 && is_label(t))
+            {
+                label_value = true;
+                v = 0;
+            } else
+            {
+                report(state, "bad " + std::string(directive) + " value: " + std::string(t));
+                v = 0;
+            }
+            uint32_t value = static_cast<uint32_t>(v);
+            uint32_t source = count == 1 ? data.append(value, size) : data.repeat(value, size, static_cast<uint32_t>(count));
+            if (label_value && count > 0)
+            {
+                state.object.relocations.push_back({FixupKind::Word, static_cast<int>(source), state.object.symbols.intern(t)});
+            }
         }
+        return;
     }
-    std::unordered_map<std::string, int> data_label_map = add_data_labels(instructions);
-
-    int static_memory_address = 0;
-    bool reading_static_memory = false;
 
-    for (std::size_t i = 0; i < instructions.size(); ++i) 
+    if (directive == ".space" || directive == ".align")
     {
-        std::string inst = instructions[i];
-
-        if (inst == ".text") 
+        int n = 0;
+        bool space = directive == ".space";
+        if (tokens.size() != 1 || !parse_immediate(tokens[0], n) || n < 0 || (!space && n > 16))
         {
-            // Stop treating lines as .data; resume normal parsing.
-            reading_static_memory = false;
-            continue;
+            report(state, "bad " + std::string(directive) + " operand: " + std::string(ltrim(line.substr(name_end))));
+            return;
         }
-
-        if (reading_static_memory) 
+        if (space && static_cast<uint32_t>(n) > DataImage::MAX_BYTES - data.size())
         {
-            // Try to parse a ".word" list on this line and append to static_memory.
-            get_static_memory(inst, static_memory_address, static_memory, label_map, data_label_map);
-            continue;
+            report(state, "static memory is too large");
+            return;
         }
+        if (!space) data.align(1u << n);
+        bind_label();
+        if (space) data.repeat(0, 1, static_cast<uint32_t>(n));
+        return;
+    }
 
-        if (inst == ".data") 
+    if (directive == ".ascii" || directive == ".asciiz")
+    {
+        bind_label();
+        std::string text;
+        for (std::string_view t : tokens)
         {
-            // Start treating subsequent lines as data section until the next ".text".
-            reading_static_memory = true;
-            continue;
+            if (t.size() < 2 || t[0] != '"' || !unescape(t, text))
+            {
+                report(state, "bad string: " + std::string(t));
+                continue;
+            }
+            for (char c : text) data.append(static_cast<uint8_t>(c), 1);
+            if (directive == ".asciiz") data.append(0, 1);
         }
+        return;
     }
 
-    std::vector<std::string> cleaned_instructions;
-    bool main_found = false;
+    report(state, "unknown data directive: " + std::string(directive));
+}
 
-    for (const std::string& inst : instructions) 
-    {
-        if (!main_found) 
-        {
-            if (inst == "main:") main_found = true;
-            continue;
-        }
-        // Skip label-only lines after main.
-        if (!inst.empty() && inst.back() == ':') continue;
+/**
+ * Parse one instruction line and append the fields of its word(s) to the
+ * file's text. Pseudo-instructions expand into the shortest sequence of
+ * native ones for their operands, at most as many words as their table
+ * entry says.
+ */
+void encode_instruction(std::string_view line, const Terms& terms, AssemblerState& state)
+{
+    if (terms.empty()) return;
 
-        // Skip assembler directives entirely.
-        if (!inst.empty() && inst[0] == '.') continue;
+    // Bad operands are reported and encoded as 0 so the rest of the line is still checked.
+    auto reg = [&](std::size_t i)
+    {
+        int r = 0;
+        if (!parse_register(terms[i], r)) report(state, "bad register: " + std::string(terms[i]));
+        return r;
+    };
+    auto number = [&](std::size_t i, int low, int high)
+    {
+        int v = 0;
+        if (!parse_immediate(terms[i], v)) report(state, "bad immediate: " + std::string(terms[i]));
+        else if (v < low || v > high) report(state, "immediate out of range: " + std::string(terms[i]));
+        return v;
+    };
+    auto imm = [&](std::size_t i) { return number(i, -32768, 65535); };
+    auto uimm = [&](std::size_t i) { return number(i, 0, 65535); };
+    auto shamt = [&](std::size_t i) { return number(i, 0, 31); };
+    auto label = [&](std::size_t i)
+    {
+        if (!is_label(terms[i])) report(state, "bad label: " + std::string(terms[i]));
+        return terms[i];
+    };
 
-        cleaned_instructions.push_back(inst);
-    }
+    InstructionFields& fields = state.fields;
+    std::size_t start = fields.size();
 
-     /** Phase 2
-     * Process all static memory, output to static memory file
-     * TODO: All of this
-     */
-    if (DEBUG) {
-        for (std::size_t i = 0; i < static_memory.size(); ++i) {
-            std::cerr << "Static [addr " << (i * 4) << "]: " << static_memory[i] << std::endl;
-        }
+    Op op;
+    if (!lookup_opcode(terms[0], op))
+    {
+        report(state, "unrecognized instruction: " + std::string(terms[0]));
+        return;
     }
-
-    for (int data : static_memory) {
-        write_binary(data, static_outfile);
+    const OpInfo& info = op_info(op);
+    state.object.op_counts[static_cast<std::size_t>(op)]++;
+    std::size_t operands = terms.size() - 1;
+    if (operands != operand_count(info.operands) &&
+        !(info.operands == Operands::Jalr && operands == 1))
+    {
+        report(state, "wrong number of operands for " + std::string(info.mnemonic) + ": " + std::string(line));
+        return;
     }
 
-    /** Phase 3
-     * Process all instructions, output to instruction memory file
-     * TODO: Almost all of this, it only works for adds
-     */
-    int current_instruction_number = 0;
-
-    for (const std::string& inst : cleaned_instructions) 
+    // Native instructions are encoded straight from their table entry.
+    if (info.format != Format::Pseudo) switch (info.operands)
     {
-        // Tokenize the instruction line by whitespace, commas, and parentheses.
-        std::vector<std::string> terms = split(inst, WHITESPACE + ",()");
-        if (terms.empty()) continue;
-        const std::string inst_type = terms[0];
-        if (inst_type == "add") 
-        {
-            write_binary(encode_Rtype(0, registers[terms[2]], registers[terms[3]], registers[terms[1]], 0, 32), inst_outfile);
-        }
-        else if (inst_type == "sub") 
-        {
-            write_binary(encode_Rtype(0, registers[terms[2]], registers[terms[3]], registers[terms[1]], 0, 34), inst_outfile);
-        }
-        else if (inst_type == "slt") 
-        {
-            write_binary(encode_Rtype(0, registers[terms[2]], registers[terms[3]], registers[terms[1]], 0, 42), inst_outfile);
-        }
-        else if (inst_type == "addi") 
-        {
-            write_binary(encode_Itype(8,  registers[terms[2]], registers[terms[1]], std::stoi(terms[3])), inst_outfile);
-        }
-        else if (inst_type == "lw") 
-        {
-            write_binary(encode_Itype(35, registers[terms[3]], registers[terms[1]], std::stoi(terms[2])), inst_outfile);
-        }
-        else if (inst_type == "sw") 
-        {
-            write_binary(encode_Itype(43, registers[terms[3]], registers[terms[1]], std::stoi(terms[2])), inst_outfile);
-        }
-        else if (inst_type == "beq") 
-        {
-            const std::string& label = terms[3];
-            int offset = label_map[label] - (current_instruction_number + 1);
-            write_binary(encode_Itype(4, registers[terms[1]], registers[terms[2]], offset), inst_outfile);
-        }
-        else if (inst_type == "bne") 
-        {
-            const std::string& label = terms[3];
-            int offset = label_map[label] - (current_instruction_number + 1);
-            write_binary(encode_Itype(5, registers[terms[1]], registers[terms[2]], offset), inst_outfile);
-        }
-        else if (inst_type == "j") 
-        {
-            const std::string& label = terms[1];
-            write_binary(encode_Jtype(2, label_map[label]), inst_outfile);
-        }
-        else if (inst_type == "jal") 
-        {
-            const std::string& label = terms[1];
-            write_binary(encode_Jtype(3, label_map[label]), inst_outfile);
-        }
-        else if (inst_type == "jr") 
-        {
-            int rs = registers[terms[1]];
-            write_binary(encode_Rtype(0, rs, 0, 0, 0, 8), inst_outfile);
-        }
-        else if (inst_type == "jalr") 
+        case Operands::RdRsRt:
+            fields.rtype(info.opcode, reg(2), reg(3), reg(1), 0, info.funct);
+            break;
+        case Operands::RtRsImm:
+            fields.itype(info.opcode, reg(2), reg(1), imm(3));
+            break;
+        case Operands::RtRsUimm:
+            fields.itype(info.opcode, reg(2), reg(1), uimm(3));
+            break;
+        case Operands::RtImm:
+            fields.itype(info.opcode, 0, reg(1), uimm(2));
+            break;
+        case Operands::RtMem:
+            fields.itype(info.opcode, reg(3), reg(1), imm(2));
+            break;
+        case Operands::RsRtLabel:
+            fields.itype(info.opcode, reg(1), reg(2), 0);
+            emit_label_use(state, FixupKind::Branch, label(3));
+            break;
+        case Operands::Label:
+            fields.jtype(info.opcode, 0);
+            emit_label_use(state, FixupKind::Jump, label(1));
+            break;
+        case Operands::Rs:
+            fields.rtype(info.opcode, reg(1), 0, 0, 0, info.funct);
+            break;
+        case Operands::Jalr:
         {
             int rd, rs;
-            if (terms.size() == 2) 
-            { rs = registers[terms[1]]; rd = 31; }
-            else 
-            { rd = registers[terms[1]]; rs = registers[terms[2]]; }
-            write_binary(encode_Rtype(0, rs, 0, rd, 0, 9), inst_outfile);
-        }
-        else if (inst_type == "syscall") 
-        {
-            write_binary(encode_Rtype(0, 0, 0, 0, 0, 12), inst_outfile);
-        }
-        else if (inst_type == "mult") 
-        {
-            write_binary(encode_Rtype(0, registers[terms[1]], registers[terms[2]], 0, 0, 24), inst_outfile);
-        }
-        else if (inst_type == "div") 
-        {
-            write_binary(encode_Rtype(0, registers[terms[1]], registers[terms[2]], 0, 0, 26), inst_outfile);
-        }
-        else if (inst_type == "mfhi") 
-        {
-            write_binary(encode_Rtype(0, 0, 0, registers[terms[1]], 0, 16), inst_outfile);
-        }
-        else if (inst_type == "mflo") 
-        {
-            write_binary(encode_Rtype(0, 0, 0, registers[terms[1]], 0, 18), inst_outfile);
-        }
-        else if (inst_type == "sll") 
-        {
-            write_binary(encode_Rtype(0, 0, registers[terms[2]], registers[terms[1]], std::stoi(terms[3]), 0), inst_outfile);
-        }
-        else if (inst_type == "srl") 
-        {
-            write_binary(encode_Rtype(0, 0, registers[terms[2]], registers[terms[1]], std::stoi(terms[3]), 2), inst_outfile);
-        }
-        else if (inst_type == "la") 
-        {
-            int rd = registers[terms[1]];
-            const std::string& sym = terms[2];
-            int addr = 0;
-            if (label_map.count(sym))          addr = label_map[sym] * 4;
-            else if (data_label_map.count(sym)) addr = data_label_map[sym];
-            int hi = (addr >> 16) & 0xFFFF;
-            int lo =  addr        & 0xFFFF;
-            write_binary(encode_Itype(15, 0, 1,  hi), inst_outfile);
-            write_binary(encode_Itype(13, 1, rd, lo), inst_outfile);
-        }
-        else if (inst_type == "sgt")
-        {
-            write_binary(encode_Rtype(0, registers[terms[3]], registers[terms[2]], registers[terms[1]], 0, 42), inst_outfile);
-        }
-        else if (inst_type == "sge")
-        {
-            int rd = registers[terms[1]], rs = registers[terms[2]], rt = registers[terms[3]];
-            write_binary(encode_Rtype(0, rs, rt, rd, 0, 42), inst_outfile);
-            write_binary(encode_Itype(8, 0, 1, 1), inst_outfile);
-            write_binary(encode_Rtype(0, rd, 1, rd, 0, 42), inst_outfile);
-        }
-        else if (inst_type == "sle")
-        {
-            int rd = registers[terms[1]], rs = registers[terms[2]], rt = registers[terms[3]];
-            write_binary(encode_Rtype(0, rt, rs, rd, 0, 42), inst_outfile);
-            write_binary(encode_Itype(8, 0, 1, 1), inst_outfile);
-            write_binary(encode_Rtype(0, rd, 1, rd, 0, 42), inst_outfile);
-        }
-        else if (inst_type == "seq")
-        {
-            int rd = registers[terms[1]], rs = registers[terms[2]], rt = registers[terms[3]];
-            write_binary(encode_Rtype(0, rs, rt, rd, 0, 42), inst_outfile);
-            write_binary(encode_Rtype(0, rt, rs, 1, 0, 42), inst_outfile);
-            write_binary(encode_Rtype(0, rd, 1, rd, 0, 32), inst_outfile);
-            write_binary(encode_Rtype(0, 0, rd, rd, 0, 42), inst_outfile);
-            write_binary(encode_Itype(8, 0, 1, 1), inst_outfile);
-            write_binary(encode_Rtype(0, rd, 1, rd, 0, 42), inst_outfile);
+            if (terms.size() == 2)
+            { rs = reg(1); rd = 31; }
+            else
+            { rd = reg(1); rs = reg(2); }
+            fields.rtype(info.opcode, rs, 0, rd, 0, info.funct);
+            break;
         }
-        else if (inst_type == "sne")
+        case Operands::RsRt:
+            fields.rtype(info.opcode, reg(1), reg(2), 0, 0, info.funct);
+            break;
+        case Operands::Rd:
+            fields.rtype(info.opcode, 0, 0, reg(1), 0, info.funct);
+            break;
+        case Operands::RdRtShamt:
+            fields.rtype(info.opcode, 0, reg(2), reg(1), shamt(3), info.funct);
+            break;
+        case Operands::None:
+            fields.rtype(info.opcode, 0, 0, 0, 0, info.funct);
+            break;
+        default:
+            break;
+    }
+    // Pseudo-instructions expand into the shortest native sequence for their operands.
+    else switch (op)
+    {
+        case Op::la:
         {
-            int rd = registers[terms[1]], rs = registers[terms[2]], rt = registers[terms[3]];
-            write_binary(encode_Rtype(0, rs, rt, rd, 0, 42), inst_outfile);
-            write_binary(encode_Rtype(0, rt, rs, 1, 0, 42), inst_outfile);
-            write_binary(encode_Rtype(0, rd, 1, rd, 0, 32), inst_outfile);
-            write_binary(encode_Rtype(0, 0, rd, rd, 0, 42), inst_outfile);
+            // With -O, link() drops the lui when the address turns out to fit in 16 bits.
+            int rd = reg(1);
+            fields.itype(15, 0, 1, 0);
+            emit_label_use(state, FixupKind::AddressHi, label(2));
+            fields.itype(13, 1, rd, 0);
+            emit_label_use(state, FixupKind::AddressLo, terms[2]);
+            break;
         }
-        else if (inst_type == "bge")
+        case Op::li:
         {
-            int rs = registers[terms[1]], rt = registers[terms[2]];
-            const std::string& label = terms[3];
-            int offset = label_map[label] - (current_instruction_number + 1);
-            write_binary(encode_Rtype(0, rs, rt, 1, 0, 42), inst_outfile);
-            write_binary(encode_Itype(4, 1, 0, offset), inst_outfile);
+            // addi or ori if the value fits in 16 bits, lui if its low half is 0, else lui + ori.
+            int rt = reg(1), v = 0;
+            if (!parse_immediate(terms[2], v)) report(state, "bad immediate: " + std::string(terms[2]));
+            uint32_t value = static_cast<uint32_t>(v);
+            if (v >= -32768 && v <= 32767) fields.itype(8, 0, rt, v);
+            else if (value <= 0xFFFF) fields.itype(13, 0, rt, v);
+            else
+            {
+                fields.itype(15, 0, rt, static_cast<int>(value >> 16));
+                if (value & 0xFFFF) fields.itype(13, rt, rt, v);
+            }
+            break;
         }
-        else if (inst_type == "bgt")
+        case Op::sgt:
+            fields.rtype(0, reg(3), reg(2), reg(1), 0, 42);
+            break;
+        case Op::sge:
+        case Op::sle:
         {
-            int rs = registers[terms[1]], rt = registers[terms[2]];
-            const std::string& label = terms[3];
-            int offset = label_map[label] - (current_instruction_number + 1);
-            write_binary(encode_Rtype(0, rt, rs, 1, 0, 42), inst_outfile);
-            write_binary(encode_Itype(5, 1, 0, offset), inst_outfile);
+            // slt, then flip the result with xori.
+            int rd = reg(1), rs = reg(2), rt = reg(3);
+            if (op == Op::sle) std::swap(rs, rt);
+            fields.rtype(0, rs, rt, rd, 0, 42);
+            fields.itype(14, rd, rd, 1);
+            break;
         }
-        else if (inst_type == "ble")
+        case Op::seq:
+        case Op::sne:
         {
-            int rs = registers[terms[1]], rt = registers[terms[2]];
-            const std::string& label = terms[3];
-            int offset = label_map[label] - (current_instruction_number + 1);
-            write_binary(encode_Rtype(0, rt, rs, 1, 0, 42), inst_outfile);
-            write_binary(encode_Itype(4, 1, 0, offset), inst_outfile);
+            // rs ^ rt is 0 exactly when they are equal; against $zero the other operand is tested directly.
+            int rd = reg(1), rs = reg(2), rt = reg(3);
+            if (rt == 0) std::swap(rs, rt);
+            int tested = rt;
+            if (rs != 0)
+            {
+                fields.rtype(0, rs, rt, rd, 0, 38);
+                tested = rd;
+            }
+            if (op == Op::seq) fields.itype(11, tested, rd, 1);
+            else fields.rtype(0, 0, tested, rd, 0, 43);
+            break;
         }
-        else if (inst_type == "blt")
+        case Op::bge:
+        case Op::bgt:
+        case Op::ble:
+        case Op::blt:
         {
-            int rs = registers[terms[1]], rt = registers[terms[2]];
-            const std::string& label = terms[3];
-            int offset = label_map[label] - (current_instruction_number + 1);
-            write_binary(encode_Rtype(0, rs, rt, 1, 0, 42), inst_outfile);
-            write_binary(encode_Itype(5, 1, 0, offset), inst_outfile);
+            // bge/blt test rs < rt, bgt/ble test rt < rs; then branch on $at.
+            int rs = reg(1), rt = reg(2);
+            if (op == Op::bgt || op == Op::ble) std::swap(rs, rt);
+            int branch_opcode = (op == Op::bge || op == Op::ble) ? 4 : 5;
+            fields.rtype(0, rs, rt, 1, 0, 42);
+            fields.itype(branch_opcode, 1, 0, 0);
+            emit_label_use(state, FixupKind::Branch, label(3));
+            break;
         }
-        else if (inst_type == "abs")
+        case Op::abs:
         {
-            int rd = registers[terms[1]], rs = registers[terms[2]];
-            write_binary(encode_Rtype(0, 0, rs, 1, 31, 3), inst_outfile);
-            write_binary(encode_Rtype(0, rs, 1, rd, 0, 38), inst_outfile);
-            write_binary(encode_Rtype(0, rd, 1, rd, 0, 34), inst_outfile);
+            int rd = reg(1), rs = reg(2);
+            fields.rtype(0, 0, rs, 1, 31, 3);
+            fields.rtype(0, rs, 1, rd, 0, 38);
+            fields.rtype(0, rd, 1, rd, 0, 34);
+            break;
         }
+        default:
+            break;
+    }
 
-        else 
-        {
-            std::cerr << "Error: unrecognized instruction: " << inst_type << std::endl;
-            exit(1);
-        }
+    state.object.op_words[static_cast<std::size_t>(op)] += static_cast<int>(fields.size() - start);
+    if (DEBUG && fields.size() - start > static_cast<std::size_t>(info.words))
+    {
+        std::cerr << "Error: " << info.mnemonic << " took " << fields.size() - start
+                  << " words, the opcode table allows " << info.words << std::endl;
+    }
+}
 
-        current_instruction_number++;
+/**
+ * Handle one cleaned source line, already split into terms at whitespace,
+ * commas and parentheses: section switches, .data contents, text labels
+ * and instructions.
+ */
+void assemble_line(std::string_view line, const Terms& terms, AssemblerState& state)
+{
+    ObjectFile& object = state.object;
+    if (line == ".data")
+    {
+        // Start treating subsequent lines as data section until the next ".text".
+        state.reading_static_memory = true;
+        return;
+    }
+    if (line == ".text")
+    {
+        // Stop treating lines as .data; resume normal parsing.
+        state.reading_static_memory = false;
+        return;
+    }
+    if (line.substr(0, 6) == ".globl")
+    {
+        for (std::size_t i = 1; i < terms.size(); i++) object.symbols[object.symbols.intern(terms[i])].global = true;
+        return;
+    }
+    if (state.reading_static_memory)
+    {
+        get_static_memory(line, state);
+        return;
     }
 
-    return 0;
+    // Skip other assembler directives.
+    if (line[0] == '.') return;
+
+    // Label-only line: "label:"
+    if (line.back() == ':')
+    {
+        int word = static_cast<int>(state.fields.size());
+        if (line == "main:" && object.main_word < 0) object.main_word = word;
+        define_label(state, line.substr(0, line.size() - 1), Section::Text, word);
+        return;
+    }
+
+    std::size_t first_word = state.fields.size();
+    encode_instruction(line, terms, state);
+    if (state.fields.size() > first_word) object.line_starts.push_back({static_cast<int>(first_word), state.line});
+}
+
+/**
+ * Empty an object for reuse. The containers keep their capacity, so a
+ * batch worker does not allocate them again for every job.
+ */
+void reset(ObjectFile& object, Endian endian)
+{
+    object.text.clear();
+    object.data.clear(endian);
+    object.symbols.clear();
+    object.relocations.clear();
+    object.line_starts.clear();
+    object.main_word = -1;
+    object.lines = 0;
+    object.op_counts.fill(0);
+    object.op_words.fill(0);
+    object.diagnostics.clear();
+}
+
+//Parse every line of text into state's object and fields; words are left for encode_fields()
+void parse_source(std::string_view text, AssemblerState& state)
+{
+    StructuralScanner scanner(text);
+    std::string_view line;
+    Terms terms;
+    while (!scanner.done())
+    {
+        scanner.next(line, terms);
+        state.line++;
+        if (line.empty()) continue;
+        assemble_line(line, terms, state);
+    }
+}
+
+/**
+ * Assemble the source text of one file into a relocatable object on this
+ * thread. Every label use is left as a relocation for link(). Lines are
+ * parsed into instruction fields and the whole text is encoded in one
+ * pass at the end.
+ */
+void assemble_serial(std::string_view text, Endian endian, ObjectFile& object)
+{
+    reset(object, endian);
+    AssemblerState state {object, endian};
+    state.fields.reserve(text.size() / 16); // a guess at the words in a file of this many bytes
+    parse_source(text, state);
+    object.lines = state.line;
+    object.text.resize(state.fields.size());
+    encode_fields(state.fields, object.text.data());
 }
 
-#endif 
+//Call work(0) ... work(count - 1) on up to `threads` threads
+template <typename Work>
+void parallel_for(std::size_t count, unsigned threads, const Work& work)
+{
+    std::atomic<std::size_t> next {0};
+    auto worker = [&]()
+    {
+        for (std::size_t i; (i = next++) < count; ) work(i);
+    };
+    std::vector<std::thread> workers;
+    for (std::size_t t = 1; t < std::min<std::size_t>(threads, count); t++) workers.emplace_back(worker);
+    worker();
+    for (std::thread& t : workers) t.join();
+}
+
+/**
+ * Intra-file parallelism
+ *
+ * A large file is cut at line boundaries into chunks, each assembled on
+ * its own into an object of its own and then merged in order. Labels need
+ * no care, since every label use is already a relocation. A chunk only
+ * has to know its first line number and whether that line is in .data or
+ * .text, which a first parallel pass that counts lines and finds .data
+ * and .text works out. Merging moves each chunk's words, data, labels and
+ * relocations past the chunks before it (prefix sums of their sizes) and
+ * interns its labels in order, so symbol ids are those of a serial run.
+ * Last, every chunk's fields are encoded straight into its slice of the
+ * file's text.
+ *
+ * A chunk's data is laid out from offset 0, which is only right if its
+ * real offset is a multiple of every alignment it asked for. If it is not,
+ * or a chunk has a problem to report, or two chunks define one label, the
+ * file is assembled again serially. Output and diagnostics are always
+ * those of assemble_serial().
+ */
+const std::size_t CHUNK_BYTES = 1 << 20;
+
+struct Chunk
+{
+    enum class Switch : uint8_t { None, Data, Text };
+
+    std::string_view text;
+    int lines = 0;                             // source lines in text
+    Switch last_switch = Switch::None;         // its last .data or .text line
+    bool starts_in_data = false;
+    int first_line = 0;                        // lines before it in the file
+    int text_base = 0;                         // words before it in the file
+    ObjectFile object;
+    InstructionFields fields;
+};
+
+//Merge chunk into object, which holds the chunks before it; false if only a serial run gets it right
+bool merge_chunk(Chunk& chunk, ObjectFile& object, std::vector<int>& symbol_ids)
+{
+    const ObjectFile& part = chunk.object;
+    int text_base = chunk.text_base;
+    int data_base = static_cast<int>(object.data.size());
+    int stored_base = static_cast<int>(object.data.stored().size());
+    if (!part.diagnostics.empty() || !object.data.append_image(part.data)) return false;
+
+    symbol_ids.resize(part.symbols.size());
+    for (std::size_t id = 0; id < part.symbols.size(); id++)
+    {
+        const Symbol& from = part.symbols[static_cast<int>(id)];
+        symbol_ids[id] = object.symbols.intern(from.name);
+        Symbol& to = object.symbols[symbol_ids[id]];
+        to.global |= from.global;
+        if (!from.defined()) continue;
+        if (to.defined()) return false;
+        to.section = from.section;
+        to.value = from.value + (from.section == Section::Text ? text_base : data_base);
+    }
+    for (const Fixup& fixup : part.relocations)
+    {
+        int word = fixup.word + (fixup.kind == FixupKind::Word ? stored_base : text_base);
+        object.relocations.push_back({fixup.kind, word, symbol_ids[static_cast<std::size_t>(fixup.symbol)]});
+    }
+    for (const LineStart& start : part.line_starts) object.line_starts.push_back({start.word + text_base, start.line});
+    if (object.main_word < 0 && part.main_word >= 0) object.main_word = part.main_word + text_base;
+    for (std::size_t op = 0; op < object.op_counts.size(); op++)
+    {
+        object.op_counts[op] += part.op_counts[op];
+        object.op_words[op] += part.op_words[op];
+    }
+    object.lines += part.lines;
+    return true;
+}
+
+/**
+ * Assemble the source text of one file into a relocatable object, on up
+ * to `threads` threads if the file is large enough to be worth cutting
+ * into chunks.
+ */
+void assemble_source(std::string_view text, Endian endian, ObjectFile& object, unsigned threads)
+{
+    std::size_t chunk_count = std::min<std::size_t>(4 * threads, text.size() / CHUNK_BYTES);
+    if (threads < 2 || chunk_count < 2) return assemble_serial(text, endian, object);
+
+    // Cut after the newline that ends each chunk's last line. A long last
+    // line can take the rest of the text, leaving fewer chunks than planned.
+    std::vector<Chunk> chunks(chunk_count);
+    std::size_t start = 0, cut = 0;
+    for (; cut < chunk_count && start < text.size(); cut++)
+    {
+        std::size_t end = cut + 1 == chunk_count ? text.size() : std::max(start, text.size() * (cut + 1) / chunk_count);
+        const void* newline = end < text.size() ? memchr(text.data() + end, '\n', text.size() - end) : nullptr;
+        end = newline ? static_cast<const char*>(newline) - text.data() + 1 : text.size();
+        chunks[cut].text = text.substr(start, end - start);
+        start = end;
+    }
+    chunks.resize(cut);
+    chunk_count = cut;
+    if (chunk_count < 2) return assemble_serial(text, endian, object);
+
+    // Pass 1: lines and the last section switch of every chunk, without cutting it into lines.
+    parallel_for(chunk_count, threads, [&](std::size_t c)
+    {
+        Chunk& chunk = chunks[c];
+        std::string_view t = chunk.text;
+        chunk.lines = static_cast<int>(std::count(t.begin(), t.end(), '\n')) + (t.back() != '\n');
+        std::size_t last = 0;
+        for (std::string_view directive : {std::string_view(".data"), std::string_view(".text")})
+        {
+            for (const char* hit = t.data(); (hit = static_cast<const char*>(memmem(hit, t.data() + t.size() - hit,
+                                                                                     directive.data(), directive.size()))); hit++)
+            {
+                std::size_t at = static_cast<std::size_t>(hit - t.data());
+                std::size_t begin = t.rfind('\n', at), end = t.find('\n', at);
+                begin = begin == std::string_view::npos ? 0 : begin + 1;
+                if (at + 1 <= last || clean(t.substr(begin, end == std::string_view::npos ? end : end - begin)) != directive) continue;
+                last = at + 1;
+                chunk.last_switch = directive == ".data" ? Chunk::Switch::Data : Chunk::Switch::Text;
+            }
+        }
+    });
+    for (std::size_t c = 1; c < chunk_count; c++)
+    {
+        const Chunk& before = chunks[c - 1];
+        chunks[c].first_line = before.first_line + before.lines;
+        chunks[c].starts_in_data = before.last_switch == Chunk::Switch::None ? before.starts_in_data
+                                                                                  : before.last_switch == Chunk::Switch::Data;
+    }
+
+    // Pass 2: assemble every chunk as if it were a file of its own.
+    parallel_for(chunk_count, threads, [&](std::size_t c)
+    {
+        Chunk& chunk = chunks[c];
+        reset(chunk.object, endian);
+        AssemblerState state {chunk.object, endian};
+        state.reading_static_memory = chunk.starts_in_data;
+        state.line = chunk.first_line;
+        state.fields.reserve(chunk.text.size() / 16);
+        parse_source(chunk.text, state);
+        chunk.object.lines = state.line - chunk.first_line;
+        chunk.fields = std::move(state.fields);
+    });
+
+    // Merge in file order, then encode every chunk into its slice of the text.
+    reset(object, endian);
+    std::size_t relocations = 0, line_starts = 0;
+    for (const Chunk& chunk : chunks)
+    {
+        relocations += chunk.object.relocations.size();
+        line_starts += chunk.object.line_starts.size();
+    }
+    object.relocations.reserve(relocations);
+    object.line_starts.reserve(line_starts);
+    std::vector<int> symbol_ids;
+    int words = 0;
+    for (Chunk& chunk : chunks)
+    {
+        chunk.text_base = words;
+        if (!merge_chunk(chunk, object, symbol_ids)) return assemble_serial(text, endian, object);
+        words += static_cast<int>(chunk.fields.size());
+    }
+    object.text.resize(static_cast<std::size_t>(words));
+    parallel_for(chunk_count, threads, [&](std::size_t c)
+    {
+        encode_fields(chunks[c].fields, object.text.data() + chunks[c].text_base);
+    });
+}
+
+/**
+ * Incremental assembly cache
+ *
+ * An object depends only on its file's contents, its byte order and the
+ * assembler, so it can be stored on disk under a hash of the three and
+ * reused by later runs, including runs of a rebuilt assembler. Bump
+ * ASSEMBLER_VERSION by hand whenever encoding, ObjectFile or the cache
+ * format changes, or old entries will be trusted.
+ */
+const char* const ASSEMBLER_VERSION = "7";
+const char CACHE_MAGIC[8] = {'A', 'S', 'M', 'C', 'A', 'C', 'H', 'E'};
+
+std::string cache_path(const std::string& cache_dir, std::string_view contents, Endian endian)
+{
+    uint64_t hash = hash_bytes(ASSEMBLER_VERSION);
+    hash = hash_bytes(endian == Endian::Little ? "EL" : "EB", hash);
+    hash = hash_bytes(contents, hash);
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+    return cache_dir + "/" + name + ".obj";
+}
+
+void save_object(const std::string& path, const ObjectFile& object)
+{
+    std::string out(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    auto put = [&](int32_t v) { out.append(reinterpret_cast<const char*>(&v), sizeof(v)); };
+    auto put_string = [&](std::string_view str) { put(static_cast<int32_t>(str.size())); out += str; };
+    auto put_words = [&](const std::vector<int>& words)
+    {
+        put(static_cast<int32_t>(words.size()));
+        out.append(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(int));
+    };
+
+    put_words(object.text);
+    put(static_cast<int32_t>(object.data.byte_order()));
+    put(static_cast<int32_t>(object.data.stored().size()));
+    out.append(reinterpret_cast<const char*>(object.data.stored().data()), object.data.stored().size());
+    put(static_cast<int32_t>(object.data.run_list().size()));
+    for (const DataImage::Run& run : object.data.run_list())
+    {
+        put(static_cast<int32_t>(run.offset));
+        put(static_cast<int32_t>(run.length));
+        put(static_cast<int32_t>(run.source));
+        put(static_cast<int32_t>(run.period));
+    }
+    put(static_cast<int32_t>(object.symbols.size()));
+    for (const Symbol& symbol : object.symbols)
+    {
+        put_string(symbol.name);
+        put(static_cast<int32_t>(symbol.section));
+        put(symbol.global);
+        put(symbol.value);
+    }
+    put(static_cast<int32_t>(object.relocations.size()));
+    for (const Fixup& fixup : object.relocations)
+    {
+        put(static_cast<int32_t>(fixup.kind));
+        put(fixup.word);
+        put(fixup.symbol);
+    }
+    put(static_cast<int32_t>(object.line_starts.size()));
+    for (const LineStart& start : object.line_starts)
+    {
+        put(start.word);
+        put(start.line);
+    }
+    put(object.main_word);
+    put(object.lines);
+    for (int count : object.op_counts) put(count);
+    for (int words : object.op_words) put(words);
+
+    // Write under a temporary name first so readers never see a partial entry.
+    std::string temp = path + "." + std::to_string(getpid()) + "." +
+                       std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+    std::ofstream file(temp, std::ios::binary);
+    file.write(out.data(), static_cast<std::streamsize>(out.size()));
+    file.close();
+    if (!file || std::rename(temp.c_str(), path.c_str()) != 0) std::remove(temp.c_str());
+}
+
+bool load_object(const std::string& path, Endian endian, ObjectFile& object)
+{
+    MappedFile file(path.c_str());
+    if (!file.ok()) return false;
+    reset(object, endian);
+    std::string_view in = file.contents();
+    std::size_t pos = sizeof(CACHE_MAGIC);
+    if (in.substr(0, pos) != std::string_view(CACHE_MAGIC, sizeof(CACHE_MAGIC))) return false;
+
+    bool ok = true;
+    auto get = [&]() -> int32_t
+    {
+        int32_t v = 0;
+        if (pos + sizeof(v) > in.size()) { ok = false; return 0; }
+        std::memcpy(&v, in.data() + pos, sizeof(v));
+        pos += sizeof(v);
+        return v;
+    };
+    auto get_count = [&](std::size_t item_size) -> std::size_t
+    {
+        int32_t n = get();
+        if (n < 0 || static_cast<std::size_t>(n) * item_size > in.size() - pos) { ok = false; return 0; }
+        return static_cast<std::size_t>(n);
+    };
+    auto get_string = [&]()
+    {
+        std::size_t n = get_count(1);
+        std::string str(in.substr(pos, n));
+        pos += n;
+        return str;
+    };
+    auto get_words = [&](std::vector<int>& words)
+    {
+        words.resize(get_count(sizeof(int)));
+        std::memcpy(words.data(), in.data() + pos, words.size() * sizeof(int));
+        pos += words.size() * sizeof(int);
+    };
+
+    get_words(object.text);
+    Endian data_endian = static_cast<Endian>(get());
+    std::vector<uint8_t> stored(get_count(1));
+    std::memcpy(stored.data(), in.data() + pos, stored.size());
+    pos += stored.size();
+    std::vector<DataImage::Run> runs(get_count(16));
+    for (DataImage::Run& run : runs)
+    {
+        run.offset = static_cast<uint32_t>(get());
+        run.length = static_cast<uint32_t>(get());
+        run.source = static_cast<uint32_t>(get());
+        run.period = static_cast<uint32_t>(get());
+    }
+    if (!ok || data_endian != endian || !object.data.restore(endian, std::move(stored), std::move(runs))) return false;
+    for (std::size_t n = get_count(16), id = 0; id < n && ok; id++)
+    {
+        std::string name = get_string();
+        Symbol& symbol = object.symbols[object.symbols.intern(name)];
+        symbol.section = static_cast<Section>(get());
+        symbol.global = get() != 0;
+        symbol.value = get();
+        if (object.symbols.size() != id + 1 || symbol.section > Section::Data) ok = false;
+    }
+    for (std::size_t n = get_count(12); n > 0 && ok; n--)
+    {
+        Fixup fixup;
+        fixup.kind = static_cast<FixupKind>(get());
+        fixup.word = get();
+        fixup.symbol = get();
+        std::size_t limit = fixup.kind == FixupKind::Word ? object.data.stored().size() - std::min<std::size_t>(3, object.data.stored().size())
+                                                          : object.text.size();
+        if (fixup.kind > FixupKind::Word || fixup.word < 0 || static_cast<std::size_t>(fixup.word) >= limit ||
+            fixup.symbol < 0 || static_cast<std::size_t>(fixup.symbol) >= object.symbols.size())
+        {
+            ok = false;
+        }
+        object.relocations.push_back(fixup);
+    }
+    for (std::size_t n = get_count(8); n > 0 && ok; n--)
+    {
+        LineStart start;
+        start.word = get();
+        start.line = get();
+        if (start.word < 0 || static_cast<std::size_t>(start.word) >= object.text.size()) ok = false;
+        object.line_starts.push_back(start);
+    }
+    object.main_word = get();
+    object.lines = get();
+    for (int& count : object.op_counts) count = get();
+    for (int& words : object.op_words) words = get();
+    return ok && pos == in.size();
+}
+
+/**
+ * Assemble one input file into object on up to `threads` threads, or reuse
+ * its object from cache_dir (if set) when the same contents were assembled
+ * before.
+ */
+void assemble_file(const char* path, const std::string& cache_dir, Endian endian, unsigned threads, ObjectFile& object)
+{
+    MappedFile infile(path);
+    if (!infile.ok())
+    {
+        reset(object, endian);
+        object.diagnostics.push_back({0, "could not open file"});
+        return;
+    }
+    if (cache_dir.empty()) return assemble_source(infile.contents(), endian, object, threads);
+
+    std::string cached = cache_path(cache_dir, infile.contents(), endian);
+    if (load_object(cached, endian, object)) return;
+
+    assemble_source(infile.contents(), endian, object, threads);
+    if (object.diagnostics.empty()) save_object(cached, object);
+}
+
+/**
+ * Write a symbol map: one "text|data <byte address> <label>" line per
+ * label, sorted by section and address, for tools that have no symbols.
+ * Text symbols hold word addresses. Returns false if the file could not be
+ * written.
+ */
+bool write_symbol_map(const char* path, const SymbolTable& exports)
+{
+    std::vector<std::pair<int, std::string_view>> text, data;
+    for (const Symbol& symbol : exports)
+    {
+        if (symbol.section == Section::Text) text.emplace_back(symbol.value * 4, symbol.name);
+        if (symbol.section == Section::Data) data.emplace_back(symbol.value, symbol.name);
+    }
+    std::sort(text.begin(), text.end());
+    std::sort(data.begin(), data.end());
+
+    std::ofstream map(path);
+    for (const auto& p : text) map << "text " << p.first << " " << p.second << "\n";
+    for (const auto& p : data) map << "data " << p.first << " " << p.second << "\n";
+    return static_cast<bool>(map);
+}
+
+/**
+ * Write a file's static memory, padded to a whole number of words. Runs
+ * are expanded into a staging buffer that goes out in bulk; a repeated
+ * pattern is expanded into one tile and then copied tile by tile.
+ */
+void write_image(const DataImage& image, WordWriter& out)
+{
+    const std::size_t STAGING_BYTES = 1 << 18;
+    std::vector<uint8_t> staging;
+    staging.reserve(STAGING_BYTES);
+    auto put = [&](const uint8_t* p, std::size_t n)
+    {
+        while (n > 0)
+        {
+            std::size_t count = std::min(n, STAGING_BYTES - staging.size());
+            staging.insert(staging.end(), p, p + count);
+            p += count;
+            n -= count;
+            if (staging.size() == STAGING_BYTES)
+            {
+                out.write_bytes(staging.data(), staging.size());
+                staging.clear();
+            }
+        }
+    };
+
+    std::vector<uint8_t> tile;
+    for (const DataImage::Run& run : image.run_list())
+    {
+        const uint8_t* pattern = image.stored().data() + run.source;
+        if (run.period == run.length)
+        {
+            put(pattern, run.length);
+            continue;
+        }
+        tile.clear();
+        do tile.insert(tile.end(), pattern, pattern + run.period);
+        while (tile.size() + run.period <= 4096 && tile.size() < run.length);
+        for (std::size_t done = 0; done < run.length; done += tile.size())
+        {
+            put(tile.data(), std::min<std::size_t>(tile.size(), run.length - done));
+        }
+    }
+    const uint8_t zeros[4] = {};
+    put(zeros, (4 - image.size() % 4) % 4);
+    out.write_bytes(staging.data(), staging.size());
+}
+
+/**
+ * What link() found, for --stats.
+ */
+struct LinkStats
+{
+    // A label use that nothing defines; its field was left 0.
+    struct Undefined
+    {
+        std::size_t file;
+        int word;               // as in Fixup
+        bool data;              // a .word, whose line is not known
+        std::string_view label; // in the file's symbol table
+    };
+
+    std::size_t text_symbols = 0, data_symbols = 0;
+    float load_factor = 0;              // of the export table
+    int relaxed = 0;                    // branches relaxed into branch + j
+    int shortened = 0;                  // la whose address fits in 16 bits, emitted as one addi or ori
+    std::size_t text_words = 0, data_words = 0;
+    bool map_written = true;            // false if the symbol map could not be written
+    std::vector<Undefined> undefined;
+};
+
+/**
+ * What link() leaves behind for a container, when asked: the exported
+ * symbols at their final addresses (text values are word indices), and the
+ * line map with words counted from main and files by input position.
+ */
+struct ProgramInfo
+{
+    struct Line
+    {
+        int word;
+        int file;
+        int line;
+    };
+
+    SymbolTable symbols;
+    std::vector<Line> lines;
+};
+
+/**
+ * A branch as seen by the layout pass. Its word is at linear position
+ * `position` (counting emitted words before any relaxation) and its target
+ * at linear position `target`.
+ */
+struct BranchSite
+{
+    int position;
+    int target;
+    bool relaxed = false; // branch around a j to the target
+};
+
+/**
+ * Where link() puts every file. Text starts at main; files before the one
+ * holding main, and anything before main in it, are left out. Text is
+ * counted in linear positions: emitted words numbered from main, before
+ * any relaxation. A label resolves to its own file's definition first,
+ * then to the exported one: a .globl definition wins over a plain one,
+ * otherwise the later file wins.
+ */
+struct Placement
+{
+    std::size_t first = 0;                        // the file holding main
+    std::vector<int> text_base;                   // linear position of each file's word 0
+    std::vector<int> data_base;                   // byte address of each file's static memory
+    int words = 0;                                // linear positions in the program
+    SymbolTable exports;                          // labels as seen from other files, placed
+    std::vector<std::vector<LabelValue>> values;  // values[file][symbol id]
+};
+
+Placement place(const std::vector<ObjectFile>& objects)
+{
+    Placement placed;
+    std::size_t& first = placed.first;
+    while (first < objects.size() && objects[first].main_word < 0) first++;
+
+    // Linear positions: emitted words numbered from main, before relaxation.
+    std::vector<int>& text_base = placed.text_base;
+    std::vector<int>& data_base = placed.data_base;
+    text_base.assign(objects.size(), 0);
+    data_base.assign(objects.size(), 0);
+    int& words = placed.words;
+    int data_bytes = 0;
+    for (std::size_t i = 0; i < objects.size(); i++)
+    {
+        data_base[i] = data_bytes;
+        data_bytes += static_cast<int>((objects[i].data.size() + 3) & ~3u);
+        if (i < first) continue;
+        if (i == first) words = -objects[i].main_word;
+        text_base[i] = words;
+        words += static_cast<int>(objects[i].text.size());
+    }
+
+    // Labels as seen from other files, placed; values are linear positions and byte addresses.
+    SymbolTable& exports = placed.exports;
+    for (std::size_t i = 0; i < objects.size(); i++)
+    {
+        for (const Symbol& symbol : objects[i].symbols)
+        {
+            if (!symbol.defined()) continue;
+            bool text = symbol.section == Section::Text;
+            int value = symbol.value + (text ? text_base[i] : data_base[i]);
+            if (text && (i < first || value < 0)) continue;
+            Symbol& exported = exports[exports.intern(symbol.name)];
+            if (exported.defined() && !symbol.global && exported.global) continue;
+            exported.section = symbol.section;
+            exported.value = value;
+            exported.global = symbol.global;
+        }
+    }
+
+    // Resolve each file's symbols once: its own definition first, then the export.
+    std::vector<std::vector<LabelValue>>& values = placed.values;
+    values.resize(objects.size());
+    for (std::size_t i = 0; i < objects.size(); i++)
+    {
+        const SymbolTable& symbols = objects[i].symbols;
+        values[i].resize(symbols.size());
+        for (std::size_t id = 0; id < symbols.size(); id++)
+        {
+            const Symbol& symbol = symbols[static_cast<int>(id)];
+            if (symbol.defined())
+            {
+                values[i][id] = label_value(symbol, text_base[i], data_base[i]);
+                continue;
+            }
+            int exported = exports.find(symbol.name);
+            if (exported >= 0) values[i][id] = label_value(exports[exported], 0, 0);
+        }
+    }
+    return placed;
+}
+
+/**
+ * -O: control-flow clean-up, run on the whole program just before link().
+ *
+ * Every emitted word is a node of the program's flow graph, at its linear
+ * position (see place()). Code is assumed to be entered only at main, at
+ * a .globl label, through a branch or jump, or at a label whose address is
+ * taken by la or .word, so jr and jalr can only reach those. Then:
+ *
+ * 1. Branches and jumps (j and jal) whose target is a j are threaded
+ *    straight to the end of the chain, as long as their own file has a
+ *    label that names it.
+ * 2. Words that cannot be reached from any entry are dropped.
+ * 3. j and branches to the word that would run next anyway are dropped.
+ *
+ * The objects are rewritten in place: dropped words leave their file's
+ * text, and labels and line starts on them move to the next word kept, so
+ * link() lays out and relaxes the smaller program as usual. -O also lets
+ * link() emit la of a low data address as one word.
+ */
+struct OptimizeStats
+{
+    int threaded = 0;   // branch and jump targets moved to the end of a chain of j
+    int removed = 0;    // words dropped
+};
+
+OptimizeStats optimize(std::vector<ObjectFile>& objects)
+{
+    OptimizeStats stats;
+    Placement placed = place(objects);
+    if (placed.first == objects.size() || placed.words <= 0) return stats;
+    const int words = placed.words;
+
+    // How control leaves each word.
+    enum class Flow : uint8_t { Next, Jump, Call, Branch, Stop };
+    std::vector<Flow> flow(words, Flow::Next);
+    std::vector<int> target(words, 0);           // for Jump, Call and Branch
+    std::vector<int> fixup_at(words, -1);        // that word's label use, in its file's relocations
+    std::vector<uint32_t> owner(words);          // file of each position
+    std::vector<uint8_t> entry(words + 1, 0);
+    entry[0] = 1;
+
+    auto in_program = [&](int position) { return position >= 0 && position < words; };
+    for (std::size_t i = placed.first; i < objects.size(); i++)
+    {
+        const ObjectFile& object = objects[i];
+        for (std::size_t w = 0; w < object.text.size(); w++)
+        {
+            int position = static_cast<int>(w) + placed.text_base[i];
+            if (!in_program(position)) continue;
+            owner[position] = static_cast<uint32_t>(i);
+            uint32_t word = static_cast<uint32_t>(object.text[w]);
+            if (word >> 26 == 0 && (word & 63) == 8) flow[position] = Flow::Stop;  // jr
+        }
+        for (std::size_t f = 0; f < object.relocations.size(); f++)
+        {
+            const Fixup& fixup = object.relocations[f];
+            const LabelValue& value = placed.values[i][static_cast<std::size_t>(fixup.symbol)];
+            int position = fixup.word + placed.text_base[i];
+            if (fixup.kind == FixupKind::Word || fixup.kind == FixupKind::AddressHi || fixup.kind == FixupKind::AddressLo)
+            {
+                // Address taken: la and .word prefer a text and a data label respectively.
+                bool text = value.in_text && (fixup.kind != FixupKind::Word || !value.in_data);
+                if (text && value.text >= 0 && value.text <= words) entry[value.text] = 1;
+                continue;
+            }
+            if (!in_program(position)) continue;
+            uint32_t opcode = static_cast<uint32_t>(object.text[fixup.word]) >> 26;
+            flow[position] = fixup.kind == FixupKind::Branch ? Flow::Branch : opcode == 3 ? Flow::Call : Flow::Jump;
+            target[position] = value.in_text ? value.text : 0;  // an undefined label encodes 0
+            if (value.in_text) fixup_at[position] = static_cast<int>(f);
+        }
+    }
+    for (const Symbol& symbol : placed.exports)
+    {
+        if (symbol.global && symbol.section == Section::Text && symbol.value >= 0 && symbol.value <= words) entry[symbol.value] = 1;
+    }
+
+    // 1. Thread chains of j. A chain is followed for a bounded number of
+    // steps, so a loop of jumps cannot hang the pass.
+    const int MAX_CHAIN = 64;
+    for (int position = 0; position < words; position++)
+    {
+        if (fixup_at[position] < 0) continue;
+        std::size_t i = owner[position];
+        ObjectFile& object = objects[i];
+        Fixup& fixup = object.relocations[static_cast<std::size_t>(fixup_at[position])];
+        int best = target[position], best_symbol = fixup.symbol;
+        int at = best;
+        for (int steps = 0; steps < MAX_CHAIN && in_program(at) && flow[at] == Flow::Jump && fixup_at[at] >= 0 && target[at] != at; steps++)
+        {
+            std::size_t jump_owner = owner[at];
+            const ObjectFile& jump_file = objects[jump_owner];
+            const Fixup& jump = jump_file.relocations[static_cast<std::size_t>(fixup_at[at])];
+            at = target[at];
+            // The new target needs a label in the branch's own file that resolves to it.
+            int id = jump_owner == i ? jump.symbol : object.symbols.find(jump_file.symbols[jump.symbol].name);
+            if (id < 0) continue;
+            const LabelValue& value = placed.values[i][static_cast<std::size_t>(id)];
+            if (!value.in_text || value.text != at) continue;
+            best = at;
+            best_symbol = id;
+        }
+        if (best != target[position])
+        {
+            fixup.symbol = best_symbol;
+            target[position] = best;
+            stats.threaded++;
+        }
+    }
+
+    // 2. Mark what can be reached from the entries.
+    std::vector<uint8_t> keep(words, 0);
+    std::vector<int> work;
+    for (int position = 0; position < words; position++) if (entry[position]) work.push_back(position);
+    auto visit = [&](int position)
+    {
+        if (in_program(position) && !keep[position])
+        {
+            keep[position] = 1;
+            work.push_back(position);
+        }
+    };
+    for (int position : work) keep[position] = 1;
+    while (!work.empty())
+    {
+        int position = work.back();
+        work.pop_back();
+        if (flow[position] != Flow::Jump && flow[position] != Flow::Stop) visit(position + 1);
+        if (flow[position] == Flow::Jump || flow[position] == Flow::Call || flow[position] == Flow::Branch) visit(target[position]);
+    }
+
+    // 3. Back to front, so next_kept[p] (the first kept position at or
+    // after p) is known for everything after the word being looked at.
+    std::vector<int> next_kept(words + 1, words);
+    for (int position = words - 1; position >= 0; position--)
+    {
+        bool to_next = (flow[position] == Flow::Jump || flow[position] == Flow::Branch) && fixup_at[position] >= 0 &&
+                       target[position] > position && next_kept[target[position]] == next_kept[position + 1];
+        if (to_next) keep[position] = 0;
+        next_kept[position] = keep[position] ? position : next_kept[position + 1];
+    }
+
+    // Rewrite each file without its dropped words.
+    for (std::size_t i = placed.first; i < objects.size(); i++)
+    {
+        ObjectFile& object = objects[i];
+        std::size_t size = object.text.size();
+        std::vector<int> new_index(size + 1);
+        std::size_t kept = 0;
+        for (std::size_t w = 0; w < size; w++)
+        {
+            new_index[w] = static_cast<int>(kept);
+            int position = static_cast<int>(w) + placed.text_base[i];
+            if (in_program(position) && !keep[position]) continue;
+            object.text[kept++] = object.text[w];
+        }
+        new_index[size] = static_cast<int>(kept);
+        if (kept == size) continue;
+        stats.removed += static_cast<int>(size - kept);
+        object.text.resize(kept);
+
+        auto dropped = [&](int w) { return new_index[w + 1] == new_index[w]; };
+        std::size_t out = 0;
+        for (const Fixup& fixup : object.relocations)
+        {
+            if (fixup.kind != FixupKind::Word && dropped(fixup.word)) continue;
+            Fixup moved = fixup;
+            if (fixup.kind != FixupKind::Word) moved.word = new_index[fixup.word];
+            object.relocations[out++] = moved;
+        }
+        object.relocations.resize(out);
+
+        for (std::size_t id = 0; id < object.symbols.size(); id++)
+        {
+            Symbol& symbol = object.symbols[static_cast<int>(id)];
+            if (symbol.section == Section::Text) symbol.value = new_index[symbol.value];
+        }
+        if (object.main_word >= 0) object.main_word = new_index[object.main_word];
+
+        // A line whose words all went takes no room; the next line starts there.
+        out = 0;
+        for (const LineStart& start : object.line_starts)
+        {
+            LineStart moved {new_index[start.word], start.line};
+            if (static_cast<std::size_t>(moved.word) == kept) continue;
+            if (out > 0 && object.line_starts[out - 1].word == moved.word) out--;
+            object.line_starts[out++] = moved;
+        }
+        object.line_starts.resize(out);
+    }
+    return stats;
+}
+
+/**
+ * --profile: execution counts by label, one "<file>:<label> <count>" or
+ * "<label> <count>" line each ('#' starts a comment), as simulate --profile
+ * writes them. <file> is the input file as named to assemble. A bare label
+ * only counts for a .globl label or one that no other file defines, since
+ * locals of the same name in different files cannot be told apart. A label
+ * listed twice gets the sum of its counts.
+ */
+using Profile = std::unordered_map<std::string_view, uint64_t>;
+
+//Read a profile; its labels are views into text. Bad lines go to errors under the given name.
+bool parse_profile(std::string_view text, const std::string& name, Profile& profile, std::vector<AssemblerError>& errors)
+{
+    bool ok = true;
+    for (std::size_t pos = 0, number = 1; pos < text.size(); number++)
+    {
+        std::string_view line = clean(next_line(text, pos));
+        if (line.empty()) continue;
+        Terms terms = split(line, WHITESPACE);
+        std::string_view digits = terms.count == 2 ? terms.term[1] : std::string_view();
+        uint64_t count = 0;
+        auto result = std::from_chars(digits.data(), digits.data() + digits.size(), count);
+        if (terms.count != 2 || result.ec != std::errc() || result.ptr != digits.data() + digits.size())
+        {
+            errors.push_back({name, static_cast<int>(number), "expected a label and a count: " + std::string(line)});
+            ok = false;
+            continue;
+        }
+        profile[terms.term[0]] += count;
+    }
+    return ok;
+}
+
+/**
+ * --profile: lay out each file's blocks so that the hot path falls
+ * through, per file, after -O and before --schedule.
+ *
+ * A block runs from one text label to the next. The first block of a file
+ * (main's, in main's file) stays first, since the program or the file
+ * before it runs into it, and so does a last block that runs into the next
+ * file. A block's count is the largest count the profile gives a label at
+ * its start. An edge goes from a block to its branch or j target, if that
+ * is a block of the same file, and to the block after it if control can
+ * fall through. The profile only counts blocks, so an edge is estimated to
+ * be taken as often as the colder of its two ends. A branch edge weighs
+ * only what following the branch with its target saves over falling
+ * through, since the fall-through then becomes the taken side.
+ *
+ * Blocks are joined into chains along the heaviest edges first, as long as
+ * the edge leaves the tail of one chain and enters the head of another
+ * (Pettis and Hansen). The first block's chain goes first, the one with
+ * the fixed last block last and the rest hottest first. Then every block
+ * is mended to mean what it did: a branch whose target now follows it is
+ * inverted (beq and bne swap) to branch to its old fall-through instead, a
+ * j to the block now after it is dropped, and a block that no longer runs
+ * into the block that used to follow it gets a j there. A file keeps its
+ * layout unless the new one takes fewer estimated branches and jumps.
+ */
+struct LayoutStats
+{
+    int blocks = 0;            // in files the profile names
+    int moved = 0;             // blocks that no longer follow the block they did
+    int inverted = 0;          // branches whose condition was flipped
+    int jumps_added = 0;
+    int jumps_removed = 0;
+    uint64_t taken_before = 0; // estimated taken branches and jumps between blocks
+    uint64_t taken_after = 0;
+};
+
+//definitions: how many files define each text label
+LayoutStats lay_out_file(ObjectFile& object, int start, const Profile& profile, std::string_view file,
+                         const std::unordered_map<std::string_view, int>& definitions)
+{
+    LayoutStats stats;
+    int size = static_cast<int>(object.text.size());
+    if (start < 0 || start >= size) return stats;
+
+    // Blocks in text order, from each label at or after start.
+    std::vector<uint8_t> starts_block(static_cast<std::size_t>(size), 0);
+    starts_block[start] = 1;
+    for (const Symbol& symbol : object.symbols)
+    {
+        if (symbol.section == Section::Text && symbol.value > start && symbol.value < size) starts_block[symbol.value] = 1;
+    }
+    std::vector<int> block_at(static_cast<std::size_t>(size), -1), first_word;
+    for (int w = start; w < size; w++)
+    {
+        if (!starts_block[w]) continue;
+        block_at[w] = static_cast<int>(first_word.size());
+        first_word.push_back(w);
+    }
+    const int blocks = static_cast<int>(first_word.size());
+    first_word.push_back(size);
+    if (blocks < 2) return stats;
+
+    std::vector<uint64_t> count(blocks, 0);
+    std::vector<int> label(blocks, -1);  // a symbol that names the block
+    bool profiled = false;
+    std::string qualified = std::string(file) + ":";
+    const std::size_t prefix = qualified.size();
+    for (std::size_t id = 0; id < object.symbols.size(); id++)
+    {
+        const Symbol& symbol = object.symbols[static_cast<int>(id)];
+        if (symbol.section != Section::Text || symbol.value < start || symbol.value >= size) continue;
+        int block = block_at[symbol.value];
+        label[block] = static_cast<int>(id);
+        qualified.resize(prefix);
+        qualified += symbol.name;
+        auto found = profile.find(qualified);
+        auto defined = definitions.find(symbol.name);
+        bool unique = symbol.global || (defined != definitions.end() && defined->second == 1);
+        if (found == profile.end() && unique) found = profile.find(symbol.name);
+        if (found == profile.end()) continue;
+        count[block] = std::max(count[block], found->second);
+        profiled = true;
+    }
+    if (!profiled) return stats;
+    stats.blocks = blocks;
+
+    // How control leaves each block's last word.
+    enum class Exit : uint8_t { Next, Branch, Jump, Stop };
+    std::vector<Exit> exits(blocks, Exit::Next);
+    std::vector<int> target(blocks, -1);    // block of this file a Branch or Jump goes to
+    std::vector<int> fixup_at(blocks, -1);  // the last word's label use
+    std::vector<int> fixup_of(static_cast<std::size_t>(size), -1);
+    for (std::size_t f = 0; f < object.relocations.size(); f++)
+    {
+        if (object.relocations[f].kind != FixupKind::Word) fixup_of[object.relocations[f].word] = static_cast<int>(f);
+    }
+    for (int b = 0; b < blocks; b++)
+    {
+        int last = first_word[b + 1] - 1;
+        uint32_t word = static_cast<uint32_t>(object.text[last]), opcode = word >> 26;
+        int f = fixup_of[last];
+        if (opcode == 0 && (word & 63) == 8) exits[b] = Exit::Stop;  // jr
+        else if ((opcode == 4 || opcode == 5) && f >= 0) exits[b] = Exit::Branch;
+        else if (opcode == 2) exits[b] = Exit::Jump;
+        if ((exits[b] != Exit::Branch && exits[b] != Exit::Jump) || f < 0) continue;
+        fixup_at[b] = f;
+        const Symbol& symbol = object.symbols[object.relocations[f].symbol];
+        if (symbol.section == Section::Text && symbol.value >= start && symbol.value < size) target[b] = block_at[symbol.value];
+    }
+    auto falls_through = [&](int b) { return exits[b] == Exit::Next || exits[b] == Exit::Branch; };
+    auto weight = [&](int from, int to) { return to < 0 ? uint64_t(0) : std::min(count[from], count[to]); };
+    const int fixed_last = falls_through(blocks - 1) ? blocks - 1 : -1;
+
+    struct Edge
+    {
+        uint64_t weight;
+        int from, to;
+    };
+    std::vector<Edge> edges;
+    for (int b = 0; b < blocks; b++)
+    {
+        int fall = b + 1 < blocks ? b + 1 : -1;
+        if (falls_through(b) && weight(b, fall)) edges.push_back({weight(b, fall), b, fall});
+        if (target[b] < 0 || target[b] == b || target[b] == fall) continue;
+        // Following a branch with its target makes the fall-through the taken side.
+        uint64_t taken = weight(b, target[b]), gain = exits[b] == Exit::Branch ? taken - std::min(taken, weight(b, fall)) : taken;
+        if (gain) edges.push_back({gain, b, target[b]});
+    }
+    std::sort(edges.begin(), edges.end(), [](const Edge& a, const Edge& b)
+    {
+        if (a.weight != b.weight) return a.weight > b.weight;
+        return a.from != b.from ? a.from < b.from : a.to < b.to;
+    });
+
+    // Chains: next and prev link their blocks, and chain() names the chain a block is in.
+    std::vector<int> next(blocks, -1), prev(blocks, -1), chain_of(blocks);
+    for (int b = 0; b < blocks; b++) chain_of[b] = b;
+    auto chain = [&](int b)
+    {
+        while (chain_of[b] != b) b = chain_of[b] = chain_of[chain_of[b]];
+        return b;
+    };
+    int chains = blocks;
+    for (const Edge& edge : edges)
+    {
+        if (next[edge.from] >= 0 || prev[edge.to] >= 0 || edge.to == 0 || edge.from == fixed_last) continue;
+        int from = chain(edge.from), to = chain(edge.to);
+        if (from == to) continue;
+        // The first and last chains cannot meet while other chains still need a place between them.
+        if (fixed_last >= 0 && chains > 2 && from == chain(0) && to == chain(fixed_last)) continue;
+        next[edge.from] = edge.to;
+        prev[edge.to] = edge.from;
+        chain_of[to] = from;
+        chains--;
+    }
+
+    std::vector<uint64_t> heat(blocks, 0);
+    std::vector<int> heads;
+    for (int b = 0; b < blocks; b++)
+    {
+        heat[chain(b)] = std::max(heat[chain(b)], count[b]);
+        if (prev[b] < 0) heads.push_back(b);
+    }
+    auto rank = [&](int head) { return head == 0 ? 0 : fixed_last >= 0 && chain(head) == chain(fixed_last) ? 2 : 1; };
+    std::sort(heads.begin(), heads.end(), [&](int a, int b)
+    {
+        if (rank(a) != rank(b)) return rank(a) < rank(b);
+        if (heat[chain(a)] != heat[chain(b)]) return heat[chain(a)] > heat[chain(b)];
+        return a < b;
+    });
+    std::vector<int> order;
+    for (int head : heads)
+    {
+        for (int b = head; b >= 0; b = next[b]) order.push_back(b);
+    }
+
+    // Estimated taken branches and jumps in the old layout and the new one.
+    for (int k = 0; k < blocks; k++)
+    {
+        int b = order[k], follows = k + 1 < blocks ? order[k + 1] : -1, fall = b + 1 < blocks ? b + 1 : -1;
+        switch (exits[b])
+        {
+            case Exit::Next:
+                if (follows != fall) stats.taken_after += weight(b, fall);
+                break;
+            case Exit::Branch:
+                stats.taken_before += weight(b, target[b]);
+                if (follows == fall) stats.taken_after += weight(b, target[b]);
+                else if (target[b] >= 0 && follows == target[b]) stats.taken_after += weight(b, fall);
+                else stats.taken_after += weight(b, target[b]) + weight(b, fall);
+                break;
+            case Exit::Jump:
+                stats.taken_before += weight(b, target[b]);
+                if (target[b] < 0 || follows != target[b]) stats.taken_after += weight(b, target[b]);
+                break;
+            case Exit::Stop:
+                break;
+        }
+    }
+    if (stats.taken_after >= stats.taken_before)
+    {
+        stats.taken_after = stats.taken_before;
+        return stats;
+    }
+
+    // Rewrite the text in the new order, mending block ends as above.
+    std::vector<int> line_of(static_cast<std::size_t>(size), 0);
+    for (std::size_t l = 0; l < object.line_starts.size(); l++)
+    {
+        int end = l + 1 < object.line_starts.size() ? object.line_starts[l + 1].word : size;
+        for (int w = object.line_starts[l].word; w < end; w++) line_of[w] = object.line_starts[l].line;
+    }
+    std::vector<int> text(object.text.begin(), object.text.begin() + start), lines(line_of.begin(), line_of.begin() + start);
+    std::vector<int> new_index(static_cast<std::size_t>(size) + 1);
+    std::vector<uint8_t> dropped(static_cast<std::size_t>(size), 0);
+    std::vector<Fixup> added;
+    for (int w = 0; w < start; w++) new_index[w] = w;
+    for (int k = 0; k < blocks; k++)
+    {
+        int b = order[k], follows = k + 1 < blocks ? order[k + 1] : -1, fall = b + 1 < blocks ? b + 1 : -1;
+        int last = first_word[b + 1] - 1;
+        if (k > 0 && order[k - 1] != b - 1) stats.moved++;
+        dropped[last] = exits[b] == Exit::Jump && target[b] >= 0 && follows == target[b];
+        for (int w = first_word[b]; w <= last; w++)
+        {
+            // A dropped word's labels go to the next word, which is where the j went.
+            new_index[w] = static_cast<int>(text.size());
+            if (dropped[w]) continue;
+            text.push_back(object.text[w]);
+            lines.push_back(line_of[w]);
+        }
+        if (dropped[last]) stats.jumps_removed++;
+        if (!falls_through(b) || fall < 0 || follows == fall) continue;
+        if (exits[b] == Exit::Branch && target[b] >= 0 && follows == target[b])
+        {
+            text.back() ^= 1 << 26;
+            object.relocations[fixup_at[b]].symbol = label[fall];
+            stats.inverted++;
+            continue;
+        }
+        added.push_back({FixupKind::Jump, static_cast<int>(text.size()), label[fall]});
+        text.push_back(2 << 26);
+        lines.push_back(line_of[last]);
+        stats.jumps_added++;
+    }
+    new_index[size] = static_cast<int>(text.size());
+
+    std::size_t out = 0;
+    for (const Fixup& fixup : object.relocations)
+    {
+        if (fixup.kind != FixupKind::Word && dropped[fixup.word]) continue;
+        Fixup moved = fixup;
+        if (fixup.kind != FixupKind::Word) moved.word = new_index[fixup.word];
+        object.relocations[out++] = moved;
+    }
+    object.relocations.resize(out);
+    object.relocations.insert(object.relocations.end(), added.begin(), added.end());
+    for (std::size_t id = 0; id < object.symbols.size(); id++)
+    {
+        Symbol& symbol = object.symbols[static_cast<int>(id)];
+        if (symbol.section == Section::Text) symbol.value = new_index[symbol.value];
+    }
+    if (object.main_word >= 0) object.main_word = new_index[object.main_word];
+    object.text.swap(text);
+    object.line_starts.clear();
+    for (std::size_t w = 0; w < lines.size(); w++)
+    {
+        if (w == 0 || lines[w] != lines[w - 1]) object.line_starts.push_back({static_cast<int>(w), lines[w]});
+    }
+    return stats;
+}
+
+//Lay out every linked file, up to `threads` at a time; names are the files as the profile names them
+LayoutStats lay_out(std::vector<ObjectFile>& objects, const std::vector<std::string>& names, const Profile& profile,
+                    unsigned threads)
+{
+    // Files before main's are not linked, and main's own words before main are dropped.
+    std::size_t first = 0;
+    while (first < objects.size() && objects[first].main_word < 0) first++;
+    std::unordered_map<std::string_view, int> definitions;
+    for (const ObjectFile& object : objects)
+    {
+        for (const Symbol& symbol : object.symbols)
+        {
+            if (symbol.section == Section::Text) definitions[symbol.name]++;
+        }
+    }
+    std::vector<LayoutStats> per_file(objects.size());
+    std::atomic<std::size_t> next_file {first};
+    auto worker = [&]()
+    {
+        for (std::size_t i; (i = next_file++) < objects.size(); )
+        {
+            per_file[i] = lay_out_file(objects[i], i == first ? objects[i].main_word : 0, profile, names[i], definitions);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (std::size_t t = 1; t < std::min<std::size_t>(threads, objects.size() - first); t++) workers.emplace_back(worker);
+    worker();
+    for (std::thread& t : workers) t.join();
+
+    LayoutStats stats;
+    for (const LayoutStats& file : per_file)
+    {
+        stats.blocks += file.blocks;
+        stats.moved += file.moved;
+        stats.inverted += file.inverted;
+        stats.jumps_added += file.jumps_added;
+        stats.jumps_removed += file.jumps_removed;
+        stats.taken_before += file.taken_before;
+        stats.taken_after += file.taken_after;
+    }
+    return stats;
+}
+
+/**
+ * --schedule: reorder instructions within basic blocks to hide pipeline
+ * stalls, per file and before link().
+ *
+ * The cost model is a classic 5-stage pipeline with forwarding. A lw
+ * result is ready two cycles after the lw issues, so a use right after it
+ * stalls one cycle. mult and div results reach HI and LO four cycles after
+ * issue. Everything else is ready for the next instruction.
+ *
+ * A block is a run of words that starts at a label or after a control
+ * transfer. Branches, jumps, syscall and unknown words never move; one
+ * that ends a run is scheduled with it as a fixed last node, so its own
+ * reads are counted. Each run becomes a dependency DAG over registers, HI,
+ * LO and memory: a sw is ordered against every lw and sw, and loads may
+ * pass each other. Runs are list-scheduled by earliest ready time, then
+ * by longest path to the end of the run. A run is only rewritten if the
+ * new order is estimated to stall less. Relocations and line starts move
+ * with their words.
+ */
+const uint64_t EFFECT_HI = 1ULL << 32;
+const uint64_t EFFECT_LO = 1ULL << 33;
+const uint64_t EFFECT_MEMORY = 1ULL << 34;
+const int LOAD_LATENCY = 2;
+const int MULDIV_LATENCY = 4;
+
+// Registers, HI, LO and memory an instruction reads and writes, as bits; $zero is left out.
+struct Effects
+{
+    enum Kind : uint8_t { Plain, Load, MulDiv, Fixed };
+    Kind kind = Fixed;
+    uint64_t reads = 0, writes = 0;
+};
+
+Effects effects_of(uint32_t word)
+{
+    auto bit = [](uint32_t r) -> uint64_t { return r ? 1ULL << r : 0; };
+    uint32_t rs = (word >> 21) & 31, rt = (word >> 16) & 31, rd = (word >> 11) & 31;
+    Effects e;
+    switch (word >> 26)
+    {
+        case 0:
+            switch (word & 63)
+            {
+                case 32: case 34: case 42: case 38:  // add sub slt xor
+                case 39: case 43:                    // nor sltu
+                    e = {Effects::Plain, bit(rs) | bit(rt), bit(rd)};
+                    break;
+                case 0: case 2: case 3:              // sll srl sra
+                    e = {Effects::Plain, bit(rt), bit(rd)};
+                    break;
+                case 24: case 26:                    // mult div
+                    e = {Effects::MulDiv, bit(rs) | bit(rt), EFFECT_HI | EFFECT_LO};
+                    break;
+                case 16:                             // mfhi
+                    e = {Effects::Plain, EFFECT_HI, bit(rd)};
+                    break;
+                case 18:                             // mflo
+                    e = {Effects::Plain, EFFECT_LO, bit(rd)};
+                    break;
+                case 8: case 9:                      // jr jalr
+                    e.reads = bit(rs);
+                    break;
+            }
+            break;
+        case 8: case 11: case 12: case 13: case 14:  // addi sltiu andi ori xori
+            e = {Effects::Plain, bit(rs), bit(rt)};
+            break;
+        case 15:                                     // lui
+            e = {Effects::Plain, 0, bit(rt)};
+            break;
+        case 35:                                     // lw
+            e = {Effects::Load, bit(rs) | EFFECT_MEMORY, bit(rt)};
+            break;
+        case 43:                                     // sw
+            e = {Effects::Plain, bit(rs) | bit(rt), EFFECT_MEMORY};
+            break;
+        case 4: case 5:                              // beq bne
+            e.reads = bit(rs) | bit(rt);
+            break;
+    }
+    return e;
+}
+
+struct ScheduleStats
+{
+    int blocks = 0;          // runs of two or more words looked at
+    int reordered = 0;       // runs rewritten
+    long stalls_before = 0;  // estimated stall cycles over all runs, each run counted once
+    long stalls_after = 0;
+};
+
+/**
+ * One run of up to MAX_NODES words as a DAG. Node k depends on node j < k
+ * if they touch the same register, HI, LO or memory and one of them
+ * writes it; latency[j][k] is how many cycles after j issues k can issue
+ * without a stall.
+ */
+class BlockScheduler
+{
+public:
+    static constexpr int MAX_NODES = 64;
+
+    void build(const int* words, int count, bool fixed_last)
+    {
+        n = count;
+        for (int k = 0; k < n; k++)
+        {
+            effects[k] = effects_of(static_cast<uint32_t>(words[k]));
+            preds[k] = succs[k] = 0;
+            for (int j = 0; j < k; j++)
+            {
+                uint64_t raw = effects[j].writes & effects[k].reads;
+                bool conflict = raw || (effects[j].reads & effects[k].writes) || (effects[j].writes & effects[k].writes);
+                if (fixed_last && k == n - 1) conflict = true;
+                if (!conflict) continue;
+                int delay = 1;
+                if (raw && effects[j].kind == Effects::Load) delay = LOAD_LATENCY;
+                if (raw && effects[j].kind == Effects::MulDiv) delay = MULDIV_LATENCY;
+                latency[j][k] = static_cast<uint8_t>(delay);
+                preds[k] |= 1ULL << j;
+                succs[j] |= 1ULL << k;
+            }
+        }
+        // Longest latency path from each node to the end of the run.
+        for (int k = n - 1; k >= 0; k--)
+        {
+            height[k] = 0;
+            for (uint64_t m = succs[k]; m; m &= m - 1)
+            {
+                int next = __builtin_ctzll(m);
+                height[k] = std::max(height[k], latency[k][next] + height[next]);
+            }
+        }
+    }
+
+    //Estimated stall cycles if the run issues in this order
+    int stalls(const int* order) const
+    {
+        int earliest[MAX_NODES] = {};
+        int cycle = 0, total = 0;
+        for (int s = 0; s < n; s++)
+        {
+            int k = order[s];
+            if (earliest[k] > cycle)
+            {
+                total += earliest[k] - cycle;
+                cycle = earliest[k];
+            }
+            issue(k, cycle++, earliest);
+        }
+        return total;
+    }
+
+    //List-schedule the run into order: earliest start first, then longest path to the end
+    void schedule(int* order) const
+    {
+        int earliest[MAX_NODES] = {};
+        uint64_t waiting[MAX_NODES];
+        uint64_t ready = 0;
+        for (int k = 0; k < n; k++)
+        {
+            waiting[k] = preds[k];
+            if (!preds[k]) ready |= 1ULL << k;
+        }
+        int cycle = 0;
+        for (int s = 0; s < n; s++)
+        {
+            int best = -1, best_start = 0;
+            for (uint64_t r = ready; r; r &= r - 1)
+            {
+                int k = __builtin_ctzll(r), start = std::max(earliest[k], cycle);
+                if (best < 0 || start < best_start || (start == best_start && height[k] > height[best]))
+                {
+                    best = k;
+                    best_start = start;
+                }
+            }
+            order[s] = best;
+            ready &= ~(1ULL << best);
+            issue(best, best_start, earliest);
+            for (uint64_t m = succs[best]; m; m &= m - 1)
+            {
+                int next = __builtin_ctzll(m);
+                waiting[next] &= ~(1ULL << best);
+                if (!waiting[next]) ready |= 1ULL << next;
+            }
+            cycle = best_start + 1;
+        }
+    }
+
+private:
+    //Node k issues at cycle; its successors can start no earlier than their latency after it
+    void issue(int k, int cycle, int* earliest) const
+    {
+        for (uint64_t m = succs[k]; m; m &= m - 1)
+        {
+            int next = __builtin_ctzll(m);
+            earliest[next] = std::max(earliest[next], cycle + latency[k][next]);
+        }
+    }
+
+    int n = 0;
+    Effects effects[MAX_NODES];
+    uint64_t preds[MAX_NODES], succs[MAX_NODES];
+    uint8_t latency[MAX_NODES][MAX_NODES];
+    int height[MAX_NODES];
+};
+
+ScheduleStats schedule_file(ObjectFile& object)
+{
+    ScheduleStats stats;
+    BlockScheduler dag;
+    std::vector<uint8_t> block_start;
+    std::vector<int> fixup_of, line_of, words, fixups, lines;
+    int size = static_cast<int>(object.text.size());
+    block_start.assign(static_cast<std::size_t>(size) + 1, 0);
+    for (const Symbol& symbol : object.symbols)
+    {
+        if (symbol.section == Section::Text && symbol.value >= 0 && symbol.value <= size) block_start[symbol.value] = 1;
+    }
+    if (object.main_word >= 0) block_start[object.main_word] = 1;
+    fixup_of.assign(static_cast<std::size_t>(size), -1);
+    for (std::size_t f = 0; f < object.relocations.size(); f++)
+    {
+        if (object.relocations[f].kind != FixupKind::Word) fixup_of[object.relocations[f].word] = static_cast<int>(f);
+    }
+    line_of.assign(static_cast<std::size_t>(size), 0);
+    for (std::size_t l = 0; l < object.line_starts.size(); l++)
+    {
+        int end = l + 1 < object.line_starts.size() ? object.line_starts[l + 1].word : size;
+        for (int w = object.line_starts[l].word; w < end; w++) line_of[w] = object.line_starts[l].line;
+    }
+
+    bool changed = false;
+    for (int first = 0; first < size; )
+    {
+        // A run of movable words, plus the fixed word that ends it if there is one.
+        int end = first;
+        while (end < size && end - first < BlockScheduler::MAX_NODES - 1 && (end == first || !block_start[end]) &&
+               effects_of(static_cast<uint32_t>(object.text[end])).kind != Effects::Fixed)
+        {
+            end++;
+        }
+        bool fixed_last = end < size && (end == first || !block_start[end]) &&
+                          effects_of(static_cast<uint32_t>(object.text[end])).kind == Effects::Fixed;
+        if (fixed_last) end++;
+        int count = end - first;
+        if (count < 2)
+        {
+            first = std::max(end, first + 1);
+            continue;
+        }
+
+        stats.blocks++;
+        dag.build(object.text.data() + first, count, fixed_last);
+        int identity[BlockScheduler::MAX_NODES], order[BlockScheduler::MAX_NODES];
+        for (int k = 0; k < count; k++) identity[k] = k;
+        int before = dag.stalls(identity), after = before;
+        if (before > 0)
+        {
+            dag.schedule(order);
+            after = dag.stalls(order);
+        }
+        stats.stalls_before += before;
+        stats.stalls_after += std::min(before, after);
+        if (after < before)
+        {
+            stats.reordered++;
+            changed = true;
+            words.assign(object.text.begin() + first, object.text.begin() + end);
+            fixups.assign(fixup_of.begin() + first, fixup_of.begin() + end);
+            lines.assign(line_of.begin() + first, line_of.begin() + end);
+            for (int s = 0; s < count; s++)
+            {
+                object.text[first + s] = words[order[s]];
+                fixup_of[first + s] = fixups[order[s]];
+                line_of[first + s] = lines[order[s]];
+                if (fixup_of[first + s] >= 0) object.relocations[fixup_of[first + s]].word = first + s;
+            }
+        }
+        first = end;
+    }
+
+    if (!changed) return stats;
+    object.line_starts.clear();
+    for (int w = 0; w < size; w++)
+    {
+        if (w == 0 || line_of[w] != line_of[w - 1]) object.line_starts.push_back({w, line_of[w]});
+    }
+    return stats;
+}
+
+//Schedule every file, up to `threads` at a time; files are independent until link()
+ScheduleStats schedule(std::vector<ObjectFile>& objects, unsigned threads)
+{
+    std::vector<ScheduleStats> per_file(objects.size());
+    std::atomic<std::size_t> next_file {0};
+    auto worker = [&]()
+    {
+        for (std::size_t i; (i = next_file++) < objects.size(); ) per_file[i] = schedule_file(objects[i]);
+    };
+    std::vector<std::thread> workers;
+    for (std::size_t t = 1; t < std::min<std::size_t>(threads, objects.size()); t++) workers.emplace_back(worker);
+    worker();
+    for (std::thread& t : workers) t.join();
+
+    ScheduleStats stats;
+    for (const ScheduleStats& file : per_file)
+    {
+        stats.blocks += file.blocks;
+        stats.reordered += file.reordered;
+        stats.stalls_before += file.stalls_before;
+        stats.stalls_after += file.stalls_after;
+    }
+    return stats;
+}
+
+/**
+ * Link step: place every file's text and data one after another (see
+ * place()), lay the text out, resolve the remaining label uses and write
+ * both outputs (and the symbol map, if map_path is set). Returns counts
+ * for --stats.
+ *
+ * Layout: a branch whose target is more than 16 bits of words away is
+ * relaxed into the opposite branch over a j to the target, which takes one
+ * more word and moves everything after it. Relaxing only ever grows the
+ * text, so repeating until no more branches need it reaches a fixed point.
+ * Before that, if short_la is set (-O), la of a data label whose address
+ * fits in 16 bits loses its lui. Data addresses do not depend on the text
+ * layout, so this is decided once, up front. la of a text label always
+ * keeps both words.
+ *
+ * Both outputs may be the same writer: static memory is written first,
+ * then the text. If info is set, it gets the symbols and line map.
+ */
+LinkStats link(std::vector<ObjectFile>& objects, WordWriter& static_outfile, WordWriter& inst_outfile, const char* map_path,
+               bool short_la, ProgramInfo* info = nullptr)
+{
+    Placement placed = place(objects);
+    std::size_t first = placed.first;
+    const std::vector<int>& text_base = placed.text_base;
+    int words = placed.words;
+    SymbolTable& exports = placed.exports;
+    const std::vector<std::vector<LabelValue>>& values = placed.values;
+
+    auto resolve = [&](std::size_t i, const Fixup& fixup) { return values[i][static_cast<std::size_t>(fixup.symbol)]; };
+    auto emitted = [&](std::size_t i, const Fixup& fixup)
+    {
+        return fixup.kind == FixupKind::Word || (i >= first && fixup.word + text_base[i] >= 0);
+    };
+
+    // Collect the branches that could need relaxing, in text order.
+    std::vector<BranchSite> sites;
+    for (std::size_t i = first; i < objects.size(); i++)
+    {
+        for (const Fixup& fixup : objects[i].relocations)
+        {
+            if (fixup.kind != FixupKind::Branch || !emitted(i, fixup)) continue;
+            LabelValue value = resolve(i, fixup);
+            if (value.in_text) sites.push_back({fixup.word + text_base[i], value.text});
+        }
+    }
+    std::sort(sites.begin(), sites.end(), [](const BranchSite& a, const BranchSite& b) { return a.position < b.position; });
+
+    // Data addresses are known before text is laid out, so la of a data
+    // label below 0x10000 can drop its lui. What is left becomes
+    // addi rt, $zero, addr, as the gold binaries write a one-word la, or
+    // ori rt, $zero, addr if addr would not survive addi's sign extension.
+    auto short_address = [&](std::size_t i, const Fixup& fixup)
+    {
+        if (!short_la || (fixup.kind != FixupKind::AddressHi && fixup.kind != FixupKind::AddressLo)) return false;
+        LabelValue value = resolve(i, fixup);
+        return !value.in_text && value.in_data && value.data < 0x10000;
+    };
+    std::vector<int> dropped; // linear positions of the lui words left out, in text order
+    for (std::size_t i = first; i < objects.size(); i++)
+    {
+        for (const Fixup& fixup : objects[i].relocations)
+        {
+            if (fixup.kind == FixupKind::AddressHi && emitted(i, fixup) && short_address(i, fixup)) dropped.push_back(fixup.word + text_base[i]);
+        }
+    }
+    std::sort(dropped.begin(), dropped.end());
+
+    // shift[p]: words added by relaxed branches, less the lui words dropped, before linear position p.
+    std::vector<int> shift(static_cast<std::size_t>(std::max(words, 0)) + 1, 0);
+    auto address = [&](int position)
+    {
+        if (position < 0 || position >= static_cast<int>(shift.size())) return position;
+        return position + shift[position];
+    };
+    auto lay_out = [&]()
+    {
+        std::size_t next = 0, next_drop = 0;
+        int added = 0;
+        for (std::size_t p = 0; p < shift.size(); p++)
+        {
+            shift[p] = added;
+            for (; next < sites.size() && sites[next].position == static_cast<int>(p); next++)
+            {
+                if (sites[next].relaxed) added++;
+            }
+            for (; next_drop < dropped.size() && dropped[next_drop] == static_cast<int>(p); next_drop++) added--;
+        }
+    };
+    if (!dropped.empty()) lay_out();
+    for (bool changed = true; changed; )
+    {
+        changed = false;
+        for (BranchSite& site : sites)
+        {
+            int offset = address(site.target) - (address(site.position) + 1);
+            if (!site.relaxed && (offset < -32768 || offset > 32767))
+            {
+                site.relaxed = true;
+                changed = true;
+            }
+        }
+        if (!changed) break;
+        lay_out();
+    }
+
+    for (std::size_t id = 0; id < exports.size(); id++)
+    {
+        Symbol& symbol = exports[static_cast<int>(id)];
+        if (symbol.section == Section::Text) symbol.value = address(symbol.value);
+    }
+    bool map_written = !map_path || write_symbol_map(map_path, exports);
+
+    if (DEBUG)
+    {
+        for (const Symbol& symbol : exports)
+        {
+            if (symbol.section == Section::Text)
+                std::cerr << "Label: " << symbol.name << "  Word: " << symbol.value << std::endl;
+            else
+                std::cerr << "Data label: " << symbol.name << "  Addr: " << symbol.value << std::endl;
+        }
+    }
+
+    // Fill in every label field; relaxed branches become "skip the next
+    // word" with the opposite condition (beq <-> bne).
+    std::vector<LinkStats::Undefined> undefined;
+    for (std::size_t i = 0; i < objects.size(); i++)
+    {
+        ObjectFile& object = objects[i];
+        for (const Fixup& fixup : object.relocations)
+        {
+            if (!emitted(i, fixup)) continue;
+            if (short_address(i, fixup))
+            {
+                if (fixup.kind == FixupKind::AddressHi) continue;
+                object.text[fixup.word] &= ~(31 << 21);
+                if (resolve(i, fixup).data < 0x8000) object.text[fixup.word] ^= (13 ^ 8) << 26; // ori -> addi
+            }
+            bool data = fixup.kind == FixupKind::Word;
+            LabelValue value = resolve(i, fixup);
+            value.text = address(value.text);
+            int position = fixup.word + text_base[i];
+            if (fixup.kind == FixupKind::Branch && value.in_text)
+            {
+                auto site = std::lower_bound(sites.begin(), sites.end(), position,
+                                             [](const BranchSite& s, int p) { return s.position < p; });
+                if (site->relaxed)
+                {
+                    object.text[fixup.word] ^= 1 << 26;
+                    object.text[fixup.word] |= 1;
+                    continue;
+                }
+            }
+            int field = 0;
+            // la has two fixups for one label use; its lui is not counted.
+            if (!label_field(fixup.kind, value, data ? 0 : address(position), field) && fixup.kind != FixupKind::AddressHi)
+            {
+                undefined.push_back({i, fixup.word, data, object.symbols[fixup.symbol].name});
+            }
+            if (data) object.data.patch(static_cast<uint32_t>(fixup.word), static_cast<uint32_t>(field));
+            else object.text[fixup.word] |= field;
+        }
+    }
+
+    std::size_t data_start = static_outfile.words();
+    for (const ObjectFile& object : objects) write_image(object.data, static_outfile);
+    std::size_t data_end = static_outfile.words();
+    std::size_t text_start = inst_outfile.words();
+    std::size_t next = 0, next_drop = 0;
+    for (std::size_t i = first; i < objects.size(); i++)
+    {
+        std::size_t start = i == first ? static_cast<std::size_t>(objects[i].main_word) : 0;
+        for (std::size_t w = start; w < objects[i].text.size(); w++)
+        {
+            int position = static_cast<int>(w) + text_base[i];
+            if (next_drop < dropped.size() && dropped[next_drop] == position)
+            {
+                next_drop++;
+                continue;
+            }
+            write_binary(objects[i].text[w], inst_outfile);
+            for (; next < sites.size() && sites[next].position == position; next++)
+            {
+                if (sites[next].relaxed) write_binary(encode_Jtype(2, address(sites[next].target) & 0x3FFFFFF), inst_outfile);
+            }
+        }
+    }
+
+    LinkStats stats;
+    for (const Symbol& symbol : exports) (symbol.section == Section::Text ? stats.text_symbols : stats.data_symbols)++;
+    stats.load_factor = exports.load_factor();
+    stats.relaxed = static_cast<int>(std::count_if(sites.begin(), sites.end(), [](const BranchSite& s) { return s.relaxed; }));
+    stats.shortened = static_cast<int>(dropped.size());
+    stats.text_words = inst_outfile.words() - text_start;
+    stats.data_words = data_end - data_start;
+    stats.map_written = map_written;
+    stats.undefined = std::move(undefined);
+
+    if (info)
+    {
+        info->lines.clear();
+        for (std::size_t i = first; i < objects.size(); i++)
+        {
+            for (const LineStart& start : objects[i].line_starts)
+            {
+                int position = start.word + text_base[i];
+                if (position >= 0) info->lines.push_back({address(position), static_cast<int>(i), start.line});
+            }
+        }
+        info->symbols = std::move(exports);
+    }
+    return stats;
+}
+
+/**
+ * Program container output (see container.h). begin_container() writes the
+ * magic and a header and directory of zeros, link() then writes static
+ * memory and text after them, and finish_container() appends the tables
+ * and patches the header and directory with where everything landed.
+ */
+const std::size_t CONTAINER_PREAMBLE_WORDS = (sizeof(ContainerHeader) + CONTAINER_SECTIONS * sizeof(ContainerSection)) / 4;
+
+void begin_container(WordWriter& out)
+{
+    out.write_bytes(CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC));
+    while (out.words() < CONTAINER_PREAMBLE_WORDS) out.write(0);
+}
+
+void finish_container(WordWriter& out, Endian endian, const LinkStats& stats, const ProgramInfo& info,
+                      const std::vector<std::string>& inputs)
+{
+    std::vector<ContainerSection> directory(CONTAINER_SECTIONS);
+    auto place = [&](SectionKind kind, std::size_t first_word, std::size_t bytes, std::size_t count)
+    {
+        directory[static_cast<uint32_t>(kind) - 1] = {static_cast<uint32_t>(kind), static_cast<uint32_t>(first_word * 4),
+                                                      static_cast<uint32_t>(bytes), static_cast<uint32_t>(count)};
+    };
+    auto bytes_since = [&](std::size_t first_word) { return (out.words() - first_word) * 4; };
+    auto put = [&](std::size_t value) { out.write(static_cast<int>(value)); };
+    place(SectionKind::Data, CONTAINER_PREAMBLE_WORDS, stats.data_words * 4, stats.data_words * 4);
+    place(SectionKind::Text, CONTAINER_PREAMBLE_WORDS + stats.data_words, stats.text_words * 4, stats.text_words);
+
+    // Names go into one pool, each followed by a NUL, as they are written.
+    std::string strings;
+    auto pool = [&](std::string_view name)
+    {
+        std::size_t offset = strings.size();
+        strings += name;
+        strings += '\0';
+        return offset;
+    };
+
+    std::vector<const Symbol*> symbols;
+    for (const Symbol& symbol : info.symbols) if (symbol.defined()) symbols.push_back(&symbol);
+    std::sort(symbols.begin(), symbols.end(), [](const Symbol* a, const Symbol* b)
+    {
+        if (a->section != b->section) return a->section < b->section;
+        if (a->value != b->value) return a->value < b->value;
+        return a->name < b->name;
+    });
+    std::size_t start = out.words();
+    for (const Symbol* symbol : symbols)
+    {
+        put(pool(symbol->name));
+        put(symbol->name.size());
+        put(symbol->hash);
+        put(static_cast<std::size_t>(symbol->section));
+        put(static_cast<std::size_t>(symbol->section == Section::Text ? symbol->value * 4 : symbol->value));
+    }
+    place(SectionKind::Symbols, start, bytes_since(start), symbols.size());
+
+    // The name index is kept at most half full, like SymbolTable's.
+    std::size_t slots = 16;
+    while (slots < symbols.size() * 2) slots *= 2;
+    std::vector<uint32_t> index(slots, CONTAINER_EMPTY_SLOT);
+    for (std::size_t id = 0; id < symbols.size(); id++)
+    {
+        std::size_t slot = symbols[id]->hash & (slots - 1);
+        while (index[slot] != CONTAINER_EMPTY_SLOT) slot = (slot + 1) & (slots - 1);
+        index[slot] = static_cast<uint32_t>(id);
+    }
+    start = out.words();
+    for (uint32_t id : index) put(id);
+    place(SectionKind::SymbolIndex, start, bytes_since(start), slots);
+
+    start = out.words();
+    for (const std::string& input : inputs)
+    {
+        put(pool(input));
+        put(input.size());
+    }
+    place(SectionKind::Files, start, bytes_since(start), inputs.size());
+
+    start = out.words();
+    for (const ProgramInfo::Line& line : info.lines)
+    {
+        put(static_cast<std::size_t>(line.word));
+        put(static_cast<std::size_t>(line.file));
+        put(static_cast<std::size_t>(line.line));
+    }
+    place(SectionKind::Lines, start, bytes_since(start), info.lines.size());
+
+    start = out.words();
+    std::size_t string_bytes = strings.size();
+    strings.resize((strings.size() + 3) & ~std::size_t(3), '\0');
+    out.write_bytes(strings.data(), strings.size());
+    place(SectionKind::Strings, start, bytes_since(start), string_bytes);
+
+    // Header after the magic, then the directory.
+    std::size_t word = sizeof(CONTAINER_MAGIC) / 4;
+    for (uint32_t value : {CONTAINER_BYTE_ORDER_MARK, CONTAINER_VERSION, endian == Endian::Big ? 1u : 0u, CONTAINER_SECTIONS,
+                           static_cast<uint32_t>(sizeof(ContainerHeader)), 0u})
+    {
+        out.patch(word++, static_cast<int>(value));
+    }
+    for (const ContainerSection& section : directory)
+    {
+        for (uint32_t value : {section.kind, section.offset, section.size, section.count}) out.patch(word++, static_cast<int>(value));
+    }
+}
+
+/**
+ * Allocations per phase, for --stats. Counting means replacing operator
+ * new, which costs every allocation an atomic increment, so only the
+ * assemble_stats build (-DCOUNT_ALLOCATIONS, see the Makefile) counts.
+ * assemble, batch and server modes and the library leave operator new
+ * alone, and their --stats has no allocations column.
+ */
+#ifdef COUNT_ALLOCATIONS
+const bool COUNTS_ALLOCATIONS = true;
+#else
+const bool COUNTS_ALLOCATIONS = false;
+#endif
+std::atomic<uint64_t> allocation_count {0};
+
+#ifdef COUNT_ALLOCATIONS
+// Not inlined into callers, so the compiler never pairs a new expression with free().
+__attribute__((noinline)) void* counted_malloc(std::size_t size, std::size_t alignment)
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (!size) size = 1;
+    if (alignment <= alignof(std::max_align_t)) return std::malloc(size);
+    void* p = nullptr;
+    return posix_memalign(&p, alignment, size) == 0 ? p : nullptr;
+}
+
+__attribute__((noinline)) void counted_free(void* p) { std::free(p); }
+#endif
+
+} // namespace
+
+#ifdef COUNT_ALLOCATIONS
+// The array forms call these by default, so they are counted too.
+void* operator new(std::size_t size)
+{
+    if (void* p = counted_malloc(size, 0)) return p;
+    throw std::bad_alloc();
+}
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    if (void* p = counted_malloc(size, static_cast<std::size_t>(alignment))) return p;
+    throw std::bad_alloc();
+}
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return counted_malloc(size, 0); }
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return counted_malloc(size, static_cast<std::size_t>(alignment));
+}
+void operator delete(void* p) noexcept { counted_free(p); }
+void operator delete(void* p, std::size_t) noexcept { counted_free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { counted_free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { counted_free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { counted_free(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { counted_free(p); }
+#endif
+
+namespace
+{
+
+/**
+ * Wall time and, in assemble_stats, allocations of each phase of a run.
+ * --time prints the times as "phase <name> <seconds>" lines on stderr for
+ * scripts such as benchrun.
+ */
+class PhaseTimer
+{
+public:
+    struct Phase
+    {
+        const char* name;
+        double seconds;
+        uint64_t allocations;
+    };
+
+    void end(const char* name)
+    {
+        auto now = std::chrono::steady_clock::now();
+        uint64_t allocations = allocation_count.load(std::memory_order_relaxed);
+        phases.push_back({name, std::chrono::duration<double>(now - start).count(), allocations - start_allocations});
+        start = now;
+        start_allocations = allocations;
+    }
+    void print() const
+    {
+        for (const Phase& p : phases) std::cerr << "phase " << p.name << " " << p.seconds << std::endl;
+    }
+    const std::vector<Phase>& list() const { return phases; }
+
+private:
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t start_allocations = allocation_count.load(std::memory_order_relaxed);
+    std::vector<Phase> phases;
+};
+
+/**
+ * Print the --stats report: phases, work done, how far each mnemonic
+ * expands, and the symbol tables. As text, or as one JSON object.
+ */
+void print_stats(std::ostream& out, bool json, const PhaseTimer& timer, const std::vector<ObjectFile>& objects,
+                 const LinkStats& link_stats, const OptimizeStats* optimized, const LayoutStats* laid_out,
+                 const ScheduleStats* scheduled)
+{
+    long lines = 0;
+    std::size_t symbols = 0, slots = 0;
+    std::array<long, static_cast<std::size_t>(Op::count)> op_counts {}, op_words {};
+    for (const ObjectFile& object : objects)
+    {
+        lines += object.lines;
+        symbols += object.symbols.size();
+        slots += object.symbols.slot_count();
+        for (std::size_t op = 0; op < op_counts.size(); op++)
+        {
+            op_counts[op] += object.op_counts[op];
+            op_words[op] += object.op_words[op];
+        }
+    }
+    // Objects count la as lui + ori; link() then dropped the lui of each shortened one.
+    op_words[static_cast<std::size_t>(Op::la)] -= link_stats.shortened;
+    float symbol_load = slots ? static_cast<float>(symbols) / slots : 0.0f;
+
+    if (json)
+    {
+        out << "{\"phases\": [";
+        for (std::size_t i = 0; i < timer.list().size(); i++)
+        {
+            const PhaseTimer::Phase& p = timer.list()[i];
+            out << (i ? ", " : "") << "{\"name\": \"" << p.name << "\", \"seconds\": " << p.seconds;
+            if (COUNTS_ALLOCATIONS) out << ", \"allocations\": " << p.allocations;
+            out << "}";
+        }
+        out << "], \"files\": " << objects.size() << ", \"lines\": " << lines
+            << ", \"text_words\": " << link_stats.text_words << ", \"data_words\": " << link_stats.data_words
+            << ", \"relaxed_branches\": " << link_stats.relaxed << ", \"shortened_la\": " << link_stats.shortened;
+        if (optimized) out << ", \"optimized\": {\"threaded\": " << optimized->threaded << ", \"removed_words\": " << optimized->removed << "}";
+        if (laid_out)
+        {
+            out << ", \"layout\": {\"blocks\": " << laid_out->blocks << ", \"moved\": " << laid_out->moved
+                << ", \"inverted\": " << laid_out->inverted << ", \"jumps_added\": " << laid_out->jumps_added
+                << ", \"jumps_removed\": " << laid_out->jumps_removed << ", \"taken_before\": " << laid_out->taken_before
+                << ", \"taken_after\": " << laid_out->taken_after << "}";
+        }
+        if (scheduled)
+        {
+            out << ", \"scheduled\": {\"blocks\": " << scheduled->blocks << ", \"reordered\": " << scheduled->reordered
+                << ", \"stalls_before\": " << scheduled->stalls_before << ", \"stalls_after\": " << scheduled->stalls_after << "}";
+        }
+        out << ", \"mnemonics\": {";
+        bool first = true;
+        for (std::size_t op = 0; op < op_counts.size(); op++)
+        {
+            if (!op_counts[op]) continue;
+            const OpInfo& info = op_info(static_cast<Op>(op));
+            out << (first ? "" : ", ") << "\"" << info.mnemonic << "\": {\"count\": " << op_counts[op]
+                << ", \"words\": " << op_words[op] << ", \"ratio\": " << static_cast<double>(op_words[op]) / op_counts[op] << "}";
+            first = false;
+        }
+        out << "}, \"symbols\": {\"text\": " << link_stats.text_symbols << ", \"data\": " << link_stats.data_symbols
+            << ", \"load_factor\": " << link_stats.load_factor
+            << ", \"files\": {\"size\": " << symbols << ", \"load_factor\": " << symbol_load << "}}}"
+            << std::endl;
+        return;
+    }
+
+    out << (COUNTS_ALLOCATIONS ? "phase        seconds  allocations\n" : "phase        seconds\n");
+    for (const PhaseTimer::Phase& p : timer.list())
+    {
+        char row[80];
+        if (COUNTS_ALLOCATIONS) snprintf(row, sizeof(row), "%-10s %9.4f %12llu\n", p.name, p.seconds, static_cast<unsigned long long>(p.allocations));
+        else snprintf(row, sizeof(row), "%-10s %9.4f\n", p.name, p.seconds);
+        out << row;
+    }
+    out << "files " << objects.size() << ", lines read " << lines << ", words emitted " << link_stats.text_words
+        << " text + " << link_stats.data_words << " data, relaxed branches " << link_stats.relaxed
+        << ", shortened la " << link_stats.shortened << "\n";
+    if (optimized) out << "optimized: " << optimized->threaded << " jumps threaded, " << optimized->removed << " words removed\n";
+    if (laid_out)
+    {
+        out << "laid out: " << laid_out->moved << " of " << laid_out->blocks << " blocks moved, " << laid_out->inverted
+            << " branches inverted, " << laid_out->jumps_added << " jumps added, " << laid_out->jumps_removed
+            << " removed, estimated taken branches " << laid_out->taken_before << " -> " << laid_out->taken_after << "\n";
+    }
+    if (scheduled)
+    {
+        out << "scheduled: " << scheduled->reordered << " of " << scheduled->blocks << " blocks reordered, estimated stalls "
+            << scheduled->stalls_before << " -> " << scheduled->stalls_after << "\n";
+    }
+    out << "mnemonic      count      words  words/use\n";
+    for (std::size_t op = 0; op < op_counts.size(); op++)
+    {
+        if (!op_counts[op]) continue;
+        const OpInfo& info = op_info(static_cast<Op>(op));
+        char row[80];
+        snprintf(row, sizeof(row), "%-8s %10ld %10ld %10.2f\n", info.mnemonic, op_counts[op], op_words[op],
+                 static_cast<double>(op_words[op]) / op_counts[op]);
+        out << row;
+    }
+    out << "exported symbols: " << link_stats.text_symbols << " text + " << link_stats.data_symbols
+        << " data, load factor " << link_stats.load_factor << "\n"
+        << "file symbol tables: " << symbols << " entries, load factor " << symbol_load << std::endl;
+}
+
+/**
+ * One program to assemble: its input files and its two output files.
+ */
+struct Job
+{
+    std::vector<std::string> inputs;
+    std::vector<std::string_view> sources; // if set, the text of each input, which is then only a name
+    bool in_memory = false;     // keep the output in the Workspace writers instead of writing files
+    std::string static_path, inst_path;
+    std::string container_path; // if set, one container replaces the two output files
+    const char* map_path = nullptr;
+    const char* profile_path = nullptr; // --profile
+    std::string_view profile;   // if set, the profile's text, which profile_path then only names
+    bool optimize = false;      // -O
+    bool schedule = false;      // --schedule
+};
+
+// Read a job from a manifest or socket line: "in1.asm ... ink.asm static.bin inst.bin".
+bool parse_job(std::string_view line, Job& job)
+{
+    std::vector<std::string> names;
+    for (std::size_t pos = 0; (pos = line.find_first_not_of(WHITESPACE, pos)) != std::string_view::npos; )
+    {
+        std::size_t end = std::min(line.find_first_of(WHITESPACE, pos), line.size());
+        names.emplace_back(line.substr(pos, end - pos));
+        pos = end;
+    }
+    if (names.size() < 3) return false;
+    job.inst_path = std::move(names.back());
+    names.pop_back();
+    job.static_path = std::move(names.back());
+    names.pop_back();
+    job.inputs = std::move(names);
+    return true;
+}
+
+/**
+ * Objects and output buffers a worker keeps from one job to the next, so
+ * batch and server runs reuse their capacity instead of allocating again.
+ */
+struct Workspace
+{
+    explicit Workspace(Endian endian) : endian(endian), static_outfile(endian), inst_outfile(endian) {}
+
+    Endian endian;
+    std::vector<ObjectFile> objects;
+    WordWriter static_outfile, inst_outfile;
+    LinkStats link_stats;
+    OptimizeStats optimize_stats;
+    LayoutStats layout_stats;
+    ScheduleStats schedule_stats;
+};
+
+/**
+ * Assemble and link one job. Problems are added to errors, with the file
+ * they are in; returns false if there were any. `threads` input files are
+ * assembled at a time. timer, if set, is given the end of each phase.
+ */
+bool run_job(const Job& job, Workspace& work, const std::string& cache_dir, unsigned threads,
+             std::vector<AssemblerError>& errors, PhaseTimer* timer)
+{
+    // Prepare output files.
+    bool container = !job.container_path.empty();
+    if (job.in_memory)
+    {
+        work.static_outfile.open_memory();
+        work.inst_outfile.open_memory();
+    } else if (container ? !work.static_outfile.open(job.container_path.c_str())
+                         : !work.static_outfile.open(job.static_path.c_str()) || !work.inst_outfile.open(job.inst_path.c_str()))
+    {
+        errors.push_back({"", 0, "could not open output files"});
+        return false;
+    }
+
+    /**
+     * Phase 1:
+     * Assemble every input file on its own into a relocatable object, on
+     * up to `threads` threads; threads left over go to cutting large files
+     * into chunks. Each line is cleaned of comments and whitespace and parsed
+     * as it is read. Static memory labels are measured in bytes and
+     * instruction labels in words, both from the start of the file.
+     */
+    std::size_t input_count = job.inputs.size();
+    unsigned file_threads = static_cast<unsigned>(std::max<std::size_t>(1, threads / std::max<std::size_t>(1, input_count)));
+    std::vector<ObjectFile>& objects = work.objects;
+    objects.resize(input_count);
+    std::atomic<std::size_t> next_file {0};
+    auto worker = [&]()
+    {
+        for (std::size_t i; (i = next_file++) < input_count; )
+        {
+            if (job.sources.empty()) assemble_file(job.inputs[i].c_str(), cache_dir, work.endian, file_threads, objects[i]);
+            else assemble_source(job.sources[i], work.endian, objects[i], file_threads);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (std::size_t t = 1; t < std::min<std::size_t>(threads, input_count); t++) workers.emplace_back(worker);
+    worker();
+    for (std::thread& t : workers) t.join();
+
+    bool failed = false;
+    for (std::size_t i = 0; i < input_count; i++)
+    {
+        for (const Diagnostic& d : objects[i].diagnostics)
+        {
+            errors.push_back({job.inputs[i], d.line, d.message});
+            failed = true;
+        }
+    }
+    // The profile's labels point into its text, so the file stays mapped until link().
+    Profile profile;
+    std::unique_ptr<MappedFile> profile_file;
+    if (job.profile_path)
+    {
+        std::string_view text = job.profile;
+        if (text.empty())
+        {
+            profile_file.reset(new MappedFile(job.profile_path));
+            text = profile_file->contents();
+        }
+        if (profile_file && !profile_file->ok())
+        {
+            errors.push_back({"", 0, std::string("could not open profile: ") + job.profile_path});
+            failed = true;
+        }
+        else if (!parse_profile(text, job.profile_path, profile, errors)) failed = true;
+    }
+    if (failed)
+    {
+        work.static_outfile.close();
+        work.inst_outfile.close();
+        return false;
+    }
+    if (timer) timer->end("assemble");
+
+    if (job.optimize)
+    {
+        work.optimize_stats = optimize(objects);
+        if (timer) timer->end("optimize");
+    }
+    if (job.profile_path)
+    {
+        work.layout_stats = lay_out(objects, job.inputs, profile, threads);
+        if (timer) timer->end("layout");
+    }
+    if (job.schedule)
+    {
+        work.schedule_stats = schedule(objects, threads);
+        if (timer) timer->end("schedule");
+    }
+
+    /** Phase 2
+     * Link the objects: lay out the text, relaxing far branches, and write
+     * static memory and instructions, or the whole container.
+     */
+    if (container)
+    {
+        ProgramInfo info;
+        begin_container(work.static_outfile);
+        work.link_stats = link(objects, work.static_outfile, work.static_outfile, job.map_path, job.optimize, &info);
+        finish_container(work.static_outfile, work.endian, work.link_stats, info, job.inputs);
+    }
+    else
+    {
+        work.link_stats = link(objects, work.static_outfile, work.inst_outfile, job.map_path, job.optimize);
+    }
+    if (timer) timer->end("link");
+
+    bool defined = work.link_stats.undefined.empty();
+    for (std::size_t u = 0; u < work.link_stats.undefined.size(); u++)
+    {
+        const LinkStats::Undefined& use = work.link_stats.undefined[u];
+        const std::vector<LineStart>& starts = objects[use.file].line_starts;
+        auto start = std::upper_bound(starts.begin(), starts.end(), use.word,
+                                      [](int word, const LineStart& s) { return word < s.word; });
+        int line = use.data || start == starts.begin() ? 0 : (start - 1)->line;
+        errors.push_back({job.inputs[use.file], line, "undefined label: " + std::string(use.label)});
+    }
+
+    bool written = work.static_outfile.close() & work.inst_outfile.close();
+    if (!written) errors.push_back({"", 0, "could not write output files"});
+    if (!work.link_stats.map_written) errors.push_back({"", 0, std::string("could not write symbol map: ") + job.map_path});
+    if (timer) timer->end("write");
+    return written && work.link_stats.map_written && defined;
+}
+
+} // namespace
+
+/**
+ * In-process API (libassemble.h): a job whose inputs and outputs are in
+ * memory, run on a Workspace the Assembler keeps.
+ */
+struct Assembler::State
+{
+    explicit State(Endian endian) : work(endian) {}
+
+    Job job;
+    Workspace work;
+};
+
+Assembler::Assembler(const AssemblerOptions& options)
+    : options(options), state(new State(options.big_endian ? Endian::Big : Endian::Little))
+{
+    state->job.in_memory = true;
+    state->job.optimize = options.optimize;
+    state->job.schedule = options.schedule;
+    if (!options.profile.empty())
+    {
+        state->job.profile_path = "profile";
+        state->job.profile = options.profile;
+    }
+}
+
+Assembler::~Assembler() = default;
+
+bool Assembler::assemble(const std::vector<AssemblerSource>& sources, AssemblerOutput& output)
+{
+    output.instructions.clear();
+    output.static_memory.clear();
+    output.errors.clear();
+    if (sources.empty())
+    {
+        output.errors.push_back({"", 0, "no sources to assemble"});
+        return false;
+    }
+
+    Job& job = state->job;
+    job.inputs.resize(sources.size());
+    job.sources.resize(sources.size());
+    for (std::size_t i = 0; i < sources.size(); i++)
+    {
+        job.inputs[i] = sources[i].name;
+        job.sources[i] = sources[i].text;
+    }
+    if (run_job(job, state->work, std::string(), std::max(1u, options.threads), output.errors, nullptr))
+    {
+        state->work.inst_outfile.copy_values(output.instructions);
+        state->work.static_outfile.copy_values(output.static_memory);
+    }
+    return output.ok();
+}
+
+AssemblerOutput assemble_program(const std::vector<AssemblerSource>& sources, const AssemblerOptions& options)
+{
+    AssemblerOutput output;
+    Assembler(options).assemble(sources, output);
+    return output;
+}
+
+std::string format_error(const AssemblerError& error)
+{
+    if (error.file.empty()) return "Error: " + error.message;
+    std::string text = error.file + ":";
+    if (error.line > 0) text += std::to_string(error.line) + ":";
+    return text + " error: " + error.message;
+}
+
+#ifndef LIBASSEMBLE
+namespace
+{
+
+/**
+ * Batch mode: run every job of a manifest (one job per line, '#' starts a
+ * comment) on `threads` workers, each with its own Workspace. Output is
+ * printed in manifest order. Returns how many jobs failed.
+ */
+int run_batch(const char* manifest_path, Endian endian, const std::string& cache_dir, unsigned threads)
+{
+    MappedFile manifest(manifest_path);
+    if (!manifest.ok())
+    {
+        std::cerr << "Error: could not open manifest: " << manifest_path << std::endl;
+        exit(1);
+    }
+    std::vector<Job> jobs;
+    std::string_view text = manifest.contents();
+    for (std::size_t pos = 0, number = 1; pos < text.size(); number++)
+    {
+        std::string_view line = clean(next_line(text, pos));
+        if (line.empty()) continue;
+        jobs.emplace_back();
+        if (!parse_job(line, jobs.back()))
+        {
+            std::cerr << manifest_path << ":" << number << ": error: expected inputs and two output files" << std::endl;
+            exit(1);
+        }
+    }
+
+    std::vector<std::string> logs(jobs.size());
+    std::vector<char> ok(jobs.size(), 0);
+    std::atomic<std::size_t> next_job {0};
+    auto worker = [&]()
+    {
+        Workspace work(endian);
+        std::vector<AssemblerError> errors;
+        for (std::size_t i; (i = next_job++) < jobs.size(); )
+        {
+            errors.clear();
+            ok[i] = run_job(jobs[i], work, cache_dir, 1, errors, nullptr);
+            for (const AssemblerError& error : errors) logs[i] += format_error(error) + "\n";
+        }
+    };
+    std::vector<std::thread> workers;
+    for (std::size_t t = 1; t < std::min<std::size_t>(threads, jobs.size()); t++) workers.emplace_back(worker);
+    worker();
+    for (std::thread& t : workers) t.join();
+
+    int failures = 0;
+    for (std::size_t i = 0; i < jobs.size(); i++)
+    {
+        std::cerr << logs[i];
+        if (!ok[i]) failures++;
+    }
+    if (failures) std::cerr << failures << " of " << jobs.size() << " jobs failed" << std::endl;
+    return failures;
+}
+
+/**
+ * Server mode: accept connections on a Unix-domain socket at socket_path.
+ * A client sends jobs as manifest lines (paths are relative to the
+ * server's working directory) and gets back, for each line, the job's
+ * error messages followed by "ok" or "failed". The line "shutdown" stops
+ * the server. Each of the `threads` workers serves one connection at a
+ * time and keeps its Workspace between jobs.
+ */
+void serve(const char* socket_path, Endian endian, const std::string& cache_dir, unsigned threads)
+{
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    if (std::strlen(socket_path) >= sizeof(address.sun_path))
+    {
+        std::cerr << "Error: socket path too long: " << socket_path << std::endl;
+        exit(1);
+    }
+    std::strcpy(address.sun_path, socket_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(listener, 64) != 0)
+    {
+        std::cerr << "Error: could not listen on " << socket_path << std::endl;
+        exit(1);
+    }
+
+    std::atomic<bool> stopping {false};
+    auto worker = [&]()
+    {
+        Workspace work(endian);
+        std::string pending;
+        char buffer[4096];
+        while (!stopping)
+        {
+            int client = accept(listener, nullptr, nullptr);
+            if (client < 0)
+            {
+                if (stopping || errno != EINTR) break;
+                continue;
+            }
+            pending.clear();
+            for (ssize_t n; !stopping && (n = read(client, buffer, sizeof(buffer))) > 0; )
+            {
+                pending.append(buffer, static_cast<std::size_t>(n));
+                std::size_t pos = 0;
+                for (std::size_t newline; (newline = pending.find('\n', pos)) != std::string::npos; pos = newline + 1)
+                {
+                    std::string_view line = clean(std::string_view(pending).substr(pos, newline - pos));
+                    if (line.empty()) continue;
+                    std::ostringstream reply;
+                    Job job;
+                    if (line == "shutdown")
+                    {
+                        stopping = true;
+                        shutdown(listener, SHUT_RDWR);
+                        reply << "ok\n";
+                    } else if (!parse_job(line, job))
+                    {
+                        reply << "Error: expected inputs and two output files\nfailed\n";
+                    } else
+                    {
+                        std::vector<AssemblerError> errors;
+                        bool ok = run_job(job, work, cache_dir, 1, errors, nullptr);
+                        for (const AssemblerError& error : errors) reply << format_error(error) << "\n";
+                        reply << (ok ? "ok\n" : "failed\n");
+                    }
+                    std::string out = reply.str();
+                    for (std::size_t sent = 0; sent < out.size(); )
+                    {
+                        ssize_t n = write(client, out.data() + sent, out.size() - sent);
+                        if (n <= 0) break;
+                        sent += static_cast<std::size_t>(n);
+                    }
+                    if (stopping) break;
+                }
+                pending.erase(0, pos);
+            }
+            close(client);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < threads; t++) workers.emplace_back(worker);
+    worker();
+    for (std::thread& t : workers) t.join();
+    close(listener);
+    unlink(socket_path);
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    // Options may appear anywhere; everything else is a file name.
+    Endian endian = Endian::Little;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    std::string cache_dir;
+    const char* map_path = nullptr;
+    const char* container_path = nullptr;
+    const char* manifest_path = nullptr;
+    const char* socket_path = nullptr;
+    bool print_times = false;
+    bool optimize = false;
+    bool schedule = false;
+    const char* profile_path = nullptr;
+    int stats = 0; // 0: none, 1: text, 2: JSON
+    std::vector<const char*> files;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string_view arg = argv[i];
+        if (arg == "-EB") endian = Endian::Big;
+        else if (arg == "-EL") endian = Endian::Little;
+        else if (arg.substr(0, 2) == "-j" && arg.size() > 2) threads = std::max(1, std::atoi(argv[i] + 2));
+        else if (arg == "--cache" && i + 1 < argc) cache_dir = argv[++i];
+        else if (arg == "--map" && i + 1 < argc) map_path = argv[++i];
+        else if (arg == "--container" && i + 1 < argc) container_path = argv[++i];
+        else if (arg == "--batch" && i + 1 < argc) manifest_path = argv[++i];
+        else if (arg == "--serve" && i + 1 < argc) socket_path = argv[++i];
+        else if (arg == "-O") optimize = true;
+        else if (arg == "--schedule") schedule = true;
+        else if (arg == "--profile" && i + 1 < argc) profile_path = argv[++i];
+        else if (arg == "--time") print_times = true;
+        else if (arg == "--stats" || arg == "--stats=text") stats = 1;
+        else if (arg == "--stats=json") stats = 2;
+        else files.push_back(argv[i]);
+    }
+
+    bool server_mode = manifest_path || socket_path;
+    std::size_t outputs = container_path ? 0 : 2;
+    if (server_mode ? !files.empty() || container_path || (manifest_path && socket_path) : files.size() < outputs + 1)
+    {
+        std::cerr
+            << "Expected Usage:\n"
+            << "  ./assemble [-EL|-EB] [-O] [--profile file] [--schedule] [-jN] [--cache dir] [--map file] [--time] [--stats[=json]] infile1.asm infile2.asm ... infilek.asm "
+            << "staticmem_outfile.bin instructions_outfile.bin\n"
+            << "  ./assemble [-EL|-EB] [-O] [--profile file] [--schedule] [-jN] [--cache dir] [--map file] [--time] [--stats[=json]] --container program.bin "
+            << "infile1.asm ... infilek.asm\n"
+            << "  ./assemble [-EL|-EB] [-jN] [--cache dir] --batch manifest\n"
+            << "  ./assemble [-EL|-EB] [-jN] [--cache dir] --serve socket\n"
+            << "  -EL  write little-endian words (default)\n"
+            << "  -EB  write big-endian words\n"
+            << "  -O   thread jumps to jumps, drop unreachable code and jumps to the next word, and\n"
+            << "       emit la of a data address below 0x10000 as one word\n"
+            << "  -jN  assemble up to N input files, or with --batch and --serve N jobs, in parallel\n"
+            << "       (default: one per core)\n"
+            << "  --cache dir      reuse objects of unchanged input files from dir\n"
+            << "  --map file       write the address of every label to file\n"
+            << "  --container file write one file with text, static memory, symbols and a line map\n"
+            << "  --profile file   lay out blocks so the hot path falls through, from the \"file:label count\"\n"
+            << "                   lines of file (see simulate --profile); a bare \"label count\" line only\n"
+            << "                   counts for a .globl label or one that no other file defines\n"
+            << "  --schedule       reorder instructions within blocks to avoid load-use and mult/div stalls\n"
+            << "  --time           print the wall time of each phase\n"
+            << "  --stats          print time, sizes and symbol table use (--stats=json for JSON); assemble_stats\n"
+            << "                   also counts allocations\n"
+            << "  --batch manifest run every job in manifest, one \"inputs... static.bin inst.bin\" per line\n"
+            << "  --serve socket   take jobs in the same form over a Unix-domain socket until \"shutdown\"\n";
+        exit(1);
+    }
+    if (!cache_dir.empty() && mkdir(cache_dir.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        std::cerr << "Error: could not create cache directory: " << cache_dir << std::endl;
+        exit(1);
+    }
+
+    if (manifest_path) return run_batch(manifest_path, endian, cache_dir, threads) ? 1 : 0;
+    if (socket_path)
+    {
+        serve(socket_path, endian, cache_dir, threads);
+        return 0;
+    }
+
+    Job job;
+    job.inputs.assign(files.begin(), files.end() - outputs);
+    if (container_path) job.container_path = container_path;
+    else
+    {
+        job.static_path = files[files.size() - 2];
+        job.inst_path = files[files.size() - 1];
+    }
+    job.map_path = map_path;
+    job.optimize = optimize;
+    job.schedule = schedule;
+    job.profile_path = profile_path;
+
+    PhaseTimer timer;
+    Workspace work(endian);
+    std::vector<AssemblerError> errors;
+    bool ok = run_job(job, work, cache_dir, threads, errors, &timer);
+    for (const AssemblerError& error : errors) std::cerr << format_error(error) << std::endl;
+    if (!ok) exit(1);
+    if (print_times) timer.print();
+    if (stats) print_stats(std::cout, stats == 2, timer, work.objects, work.link_stats, optimize ? &work.optimize_stats : nullptr,
+                           profile_path ? &work.layout_stats : nullptr, schedule ? &work.schedule_stats : nullptr);
+    return 0;
+}
+#endif
 
+#endif
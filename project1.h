@@ -2,58 +2,486 @@
 #define __PROJECT1_H__
 
 #include <math.h>
+#include <algorithm>
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <unordered_map>
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <charconv>
+#include <cstring>
+#include <memory>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 /**
  * Helper Functions for String Processing
+ *
+ * These work on std::string_view slices of the input, so trimming,
+ * cleaning and splitting a line never copies or allocates.
  */
 
-const std::string WHITESPACE = " \n\r\t\f\v";
+constexpr std::string_view WHITESPACE = " \n\r\t\f\v";
+constexpr std::string_view DELIMITERS = " \n\r\t\f\v,()";
  
 //Remove all whitespace from the left of the string
-std::string ltrim(const std::string &s)
+inline std::string_view ltrim(std::string_view s)
 {
     size_t start = s.find_first_not_of(WHITESPACE);
-    return (start == std::string::npos) ? "" : s.substr(start);
+    return (start == std::string_view::npos) ? std::string_view() : s.substr(start);
 }
  
 //Remove all whitespace from the right of the string
-std::string rtrim(const std::string &s)
+inline std::string_view rtrim(std::string_view s)
 {
     size_t end = s.find_last_not_of(WHITESPACE);
-    return (end == std::string::npos) ? "" : s.substr(0, end + 1);
+    return (end == std::string_view::npos) ? std::string_view() : s.substr(0, end + 1);
 }
 
-std::vector<std::string> split(const std::string &s, const std::string &split_on) {
-    std::vector<std::string> split_terms;
-    int cur_pos = 0;
-    while(cur_pos != std::string::npos) {
-        int new_pos = s.find_first_not_of(split_on, cur_pos);
+//Terms of one split line. Holds the first MAX_TERMS terms; count keeps counting past that.
+struct Terms {
+    static constexpr size_t MAX_TERMS = 8;
+    std::string_view term[MAX_TERMS];
+    size_t count = 0;
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    std::string_view operator[](size_t i) const { return i < MAX_TERMS ? term[i] : std::string_view(); }
+};
+
+inline Terms split(std::string_view s, std::string_view split_on) {
+    Terms split_terms;
+    size_t cur_pos = 0;
+    while(cur_pos != std::string_view::npos) {
+        size_t new_pos = s.find_first_not_of(split_on, cur_pos);
+        if(new_pos == std::string_view::npos) break;
         cur_pos = s.find_first_of(split_on, new_pos);
-        if(new_pos == -1 && cur_pos == -1) break;
-        split_terms.push_back(s.substr(new_pos,cur_pos-new_pos));
+        if(split_terms.count < Terms::MAX_TERMS)
+            split_terms.term[split_terms.count] = s.substr(new_pos, cur_pos - new_pos);
+        split_terms.count++;
     }
     return split_terms;
 }
 
-//Remove all comments and leading/trailing whitespace
-std::string clean(const std::string &s)
+//Remove all comments and leading/trailing whitespace; a '#' inside a "string" is kept
+inline std::string_view clean(std::string_view s)
+{
+    size_t comment = s.find('#');
+    if (comment != std::string_view::npos && s.find('"') < comment) {
+        bool quoted = false;
+        for (comment = 0; comment < s.size(); comment++) {
+            if (s[comment] == '\\' && quoted) comment++;
+            else if (s[comment] == '"') quoted = !quoted;
+            else if (s[comment] == '#' && !quoted) break;
+        }
+    }
+    return rtrim(ltrim(s.substr(0, comment)));
+}
+
+//64-bit FNV-1a hash of a byte string, continuing from a previous hash if given
+inline uint64_t hash_bytes(std::string_view s, uint64_t hash = 0xcbf29ce484222325ULL)
 {
-    return rtrim(ltrim(s.substr(0,s.find('#'))));
+    for (unsigned char c : s) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Read-only memory mapping of an input file. The whole file is visible as
+ * one string_view for the lifetime of the object.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(const char *path) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            size = static_cast<size_t>(st.st_size);
+            if (size == 0) {
+                valid = true;
+            } else {
+                void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    madvise(p, size, MADV_SEQUENTIAL);
+                    data = static_cast<const char *>(p);
+                    valid = true;
+                }
+            }
+        }
+        close(fd);
+    }
+    ~MappedFile() {
+        if (data) munmap(const_cast<char *>(data), size);
+    }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool ok() const { return valid; }
+    std::string_view contents() const { return std::string_view(data, data ? size : 0); }
+
+private:
+    const char *data = nullptr;
+    size_t size = 0;
+    bool valid = false;
+};
+
+//Return the next line of text (without its newline) and advance pos past it
+inline std::string_view next_line(std::string_view text, size_t &pos) {
+    const char *start = text.data() + pos;
+    size_t remaining = text.size() - pos;
+    const char *newline = static_cast<const char *>(memchr(start, '\n', remaining));
+    size_t length = newline ? static_cast<size_t>(newline - start) : remaining;
+    pos += newline ? length + 1 : length;
+    return std::string_view(start, length);
+}
+
+/**
+ * Structural index
+ *
+ * Instead of finding newlines, comments, whitespace and delimiters with a
+ * search per line, the scanner classifies the input 64 bytes at a time
+ * into one bit mask per character class, and lines are cut, cleaned and
+ * split from those masks. Masks are kept for a window of the input that
+ * slides forward as lines are taken, so the index costs a fixed 20 KiB
+ * whatever the file size. The classifier uses AVX2 if the CPU has it,
+ * else SSE2, else a plain loop; all three give the same masks.
+ */
+struct ClassMasks {
+    uint64_t newline;  // '\n'
+    uint64_t hash;     // '#'
+    uint64_t quote;    // '"'
+    uint64_t space;    // WHITESPACE
+    uint64_t punct;    // ',' '(' ')': with space, the DELIMITERS
+};
+
+inline void classify_scalar(const char *p, ClassMasks &m) {
+    m = ClassMasks {};
+    for (int i = 0; i < 64; i++) {
+        uint64_t bit = 1ULL << i;
+        char c = p[i];
+        if (c == '\n') m.newline |= bit;
+        if (c == '#') m.hash |= bit;
+        if (c == '"') m.quote |= bit;
+        if (c == ' ' || (c >= '\t' && c <= '\r')) m.space |= bit;
+        if (c == ',' || c == '(' || c == ')') m.punct |= bit;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) inline uint64_t equal_bits32(__m256i x, char c) {
+    return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(c))));
+}
+
+__attribute__((target("avx2"))) inline void classify_avx2(const char *p, ClassMasks &m) {
+    m = ClassMasks {};
+    for (int half = 0; half < 2; half++) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 32 * half));
+        // \t..\r are 9..13: subtract 9 and they are the bytes that stay at most 4.
+        __m256i control = _mm256_sub_epi8(x, _mm256_set1_epi8(9));
+        control = _mm256_cmpeq_epi8(_mm256_min_epu8(control, _mm256_set1_epi8(4)), control);
+        int shift = 32 * half;
+        m.newline |= equal_bits32(x, '\n') << shift;
+        m.hash |= equal_bits32(x, '#') << shift;
+        m.quote |= equal_bits32(x, '"') << shift;
+        m.space |= (equal_bits32(x, ' ') | static_cast<uint32_t>(_mm256_movemask_epi8(control))) << shift;
+        m.punct |= (equal_bits32(x, ',') | equal_bits32(x, '(') | equal_bits32(x, ')')) << shift;
+    }
+}
+#endif
+
+#if defined(__SSE2__)
+inline uint64_t equal_bits16(__m128i x, char c) {
+    return static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8(c))));
+}
+
+inline void classify_sse2(const char *p, ClassMasks &m) {
+    m = ClassMasks {};
+    for (int quarter = 0; quarter < 4; quarter++) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * quarter));
+        __m128i control = _mm_sub_epi8(x, _mm_set1_epi8(9));
+        control = _mm_cmpeq_epi8(_mm_min_epu8(control, _mm_set1_epi8(4)), control);
+        int shift = 16 * quarter;
+        m.newline |= equal_bits16(x, '\n') << shift;
+        m.hash |= equal_bits16(x, '#') << shift;
+        m.quote |= equal_bits16(x, '"') << shift;
+        m.space |= (equal_bits16(x, ' ') | static_cast<uint16_t>(_mm_movemask_epi8(control))) << shift;
+        m.punct |= (equal_bits16(x, ',') | equal_bits16(x, '(') | equal_bits16(x, ')')) << shift;
+    }
+}
+#endif
+
+using Classifier = void (*)(const char *, ClassMasks &);
+
+inline Classifier pick_classifier() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) return classify_avx2;
+#endif
+#if defined(__SSE2__)
+    return classify_sse2;
+#else
+    return classify_scalar;
+#endif
+}
+
+class StructuralScanner {
+public:
+    static constexpr size_t WINDOW_BLOCKS = 512;
+
+    explicit StructuralScanner(std::string_view text) : text(text), blocks(WINDOW_BLOCKS) {}
+
+    bool done() const { return pos >= text.size(); }
+
+    /**
+     * Take the next line. line is what clean(next_line()) gives and terms
+     * what split(line, DELIMITERS) gives. Lines too long for the window,
+     * and lines with a '"' before a '#', go through those functions.
+     */
+    void next(std::string_view &line, Terms &terms) {
+        size_t start = pos;
+        if (start < base || start >= window_end) index(start);
+        size_t end = first(&ClassMasks::newline, start, window_end, true);
+        if (end == window_end && window_end < text.size()) {
+            if (base != (start & ~size_t(63))) {
+                index(start);
+                end = first(&ClassMasks::newline, start, window_end, true);
+            }
+            if (end == window_end && window_end < text.size()) {
+                line = clean(next_line(text, pos));
+                terms = split(line, DELIMITERS);
+                return;
+            }
+        }
+        pos = end < text.size() ? end + 1 : end;
+
+        size_t comment = first(&ClassMasks::hash, start, end, true);
+        if (first(&ClassMasks::quote, start, comment, true) < comment) {
+            line = clean(text.substr(start, end - start));
+            terms = split(line, DELIMITERS);
+            return;
+        }
+        size_t from = first(&ClassMasks::space, start, comment, false);
+        size_t to = from == comment ? from : last_clear_space(from, comment) + 1;
+        line = text.substr(from, to - from);
+        split_terms(from, to, terms);
+    }
+
+private:
+    //Classify the blocks of the window that starts with the block holding at
+    void index(size_t at) {
+        base = at & ~size_t(63);
+        window_end = std::min(text.size(), base + 64 * WINDOW_BLOCKS);
+        for (size_t b = 0; base + 64 * b < window_end; b++) {
+            size_t offset = base + 64 * b;
+            if (offset + 64 <= text.size()) {
+                classify(text.data() + offset, blocks[b]);
+            } else {
+                char padded[64] = {};
+                memcpy(padded, text.data() + offset, text.size() - offset);
+                classify_scalar(padded, blocks[b]);
+            }
+        }
+    }
+
+    uint64_t bits(uint64_t ClassMasks::*mask, size_t block, bool set) const {
+        uint64_t m = blocks[block].*mask;
+        return set ? m : ~m;
+    }
+
+    //First position in [from, to) whose bit in mask is set (or clear), or to
+    size_t first(uint64_t ClassMasks::*mask, size_t from, size_t to, bool set) const {
+        while (from < to) {
+            size_t b = (from - base) / 64;
+            uint64_t m = bits(mask, b, set) & (~0ULL << ((from - base) % 64));
+            if (m) return std::min(to, base + 64 * b + __builtin_ctzll(m));
+            from = base + 64 * (b + 1);
+        }
+        return to;
+    }
+
+    //Last position in [from, to) that is not whitespace; from must be one
+    size_t last_clear_space(size_t from, size_t to) const {
+        size_t b = (to - 1 - base) / 64;
+        uint64_t m = bits(&ClassMasks::space, b, false) & (~0ULL >> (63 - (to - 1 - base) % 64));
+        while (!m && base + 64 * b > from) m = bits(&ClassMasks::space, --b, false);
+        return base + 64 * b + 63 - __builtin_clzll(m);
+    }
+
+    //Split [from, to) at runs of delimiters: a term starts and ends where the delimiter bit changes
+    void split_terms(size_t from, size_t to, Terms &terms) const {
+        terms.count = 0;
+        size_t term_start = 0;
+        bool inside = false;
+        for (size_t at = from; at < to; ) {
+            size_t b = (at - base) / 64, low = (at - base) % 64;
+            size_t block_start = base + 64 * b;
+            size_t high = std::min<size_t>(64, to - block_start);
+            uint64_t range = (~0ULL << low) & (high == 64 ? ~0ULL : (1ULL << high) - 1);
+            uint64_t word = ~(blocks[b].space | blocks[b].punct) & range;
+            uint64_t edges = (word ^ ((word << 1) | uint64_t(inside) << low)) & range;
+            for (; edges; edges &= edges - 1) {
+                size_t p = block_start + __builtin_ctzll(edges);
+                if (!inside) {
+                    term_start = p;
+                } else {
+                    if (terms.count < Terms::MAX_TERMS) terms.term[terms.count] = text.substr(term_start, p - term_start);
+                    terms.count++;
+                }
+                inside = !inside;
+            }
+            at = block_start + 64;
+        }
+        if (inside) {
+            if (terms.count < Terms::MAX_TERMS) terms.term[terms.count] = text.substr(term_start, to - term_start);
+            terms.count++;
+        }
+    }
+
+    std::string_view text;
+    std::vector<ClassMasks> blocks;       // masks of the window, one per 64 bytes
+    size_t pos = 0;                       // start of the next line
+    size_t base = 0, window_end = 0;      // text offsets the window covers; base is a multiple of 64
+    Classifier classify = pick_classifier();
+};
+
+/**
+ * Buffered binary output
+ *
+ * Words are collected into a block in memory and written with one write(2)
+ * per block, in the byte order chosen on the command line. A word can be
+ * patched after it was written: in the block if it is still there,
+ * otherwise in place in the file. A writer opened with open_memory() keeps
+ * every word in memory instead, for the in-process API.
+ */
+enum class Endian { Little, Big };
+
+constexpr Endian host_endian() {
+    return __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__ ? Endian::Big : Endian::Little;
 }
 
+class WordWriter {
+public:
+    static constexpr size_t BLOCK_WORDS = 1 << 16;
+
+    explicit WordWriter(Endian endian = Endian::Little) : swap(endian != host_endian()) {
+        buffer.reserve(BLOCK_WORDS);
+    }
+    ~WordWriter() { close(); }
+    WordWriter(const WordWriter &) = delete;
+    WordWriter &operator=(const WordWriter &) = delete;
+
+    //Start writing a new file; a writer can be reopened and keeps its buffer
+    bool open(const char *path) {
+        close();
+        buffer.clear();
+        flushed = 0;
+        failed = false;
+        in_memory = false;
+        fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        return fd >= 0;
+    }
+
+    //Start collecting words in memory; nothing is written until the writer is reopened
+    void open_memory() {
+        close();
+        buffer.clear();
+        flushed = 0;
+        failed = false;
+        in_memory = true;
+    }
+
+    void write(int value) {
+        buffer.push_back(order(value));
+        if (buffer.size() == BLOCK_WORDS) flush();
+    }
+
+    //Append whole words whose bytes are already in file order; n must be a multiple of 4
+    void write_bytes(const void *data, size_t n) {
+        const char *p = static_cast<const char *>(data);
+        while (n >= sizeof(uint32_t)) {
+            size_t count = in_memory ? n / sizeof(uint32_t) : std::min(n / sizeof(uint32_t), BLOCK_WORDS - buffer.size());
+            size_t old = buffer.size();
+            buffer.resize(old + count);
+            memcpy(buffer.data() + old, p, count * sizeof(uint32_t));
+            p += count * sizeof(uint32_t);
+            n -= count * sizeof(uint32_t);
+            if (buffer.size() == BLOCK_WORDS) flush();
+        }
+    }
+
+    //Overwrite the word at index (counted from the start of the file)
+    void patch(size_t index, int value) {
+        uint32_t word = order(value);
+        if (index >= flushed) {
+            buffer[index - flushed] = word;
+        } else if (fd >= 0 && pwrite(fd, &word, sizeof(word), index * sizeof(word)) != sizeof(word)) {
+            failed = true;
+        }
+    }
+
+    size_t words() const { return flushed + buffer.size(); }
+
+    //The words collected since open_memory(), as values read back in the writer's byte order
+    void copy_values(std::vector<uint32_t> &values) const {
+        values.resize(buffer.size());
+        for (size_t i = 0; i < buffer.size(); i++) values[i] = swap ? __builtin_bswap32(buffer[i]) : buffer[i];
+    }
+
+    //Flush and close the file, returns false if any write failed
+    bool close() {
+        if (fd >= 0) {
+            flush();
+            if (::close(fd) != 0) failed = true;
+            fd = -1;
+        }
+        return !failed;
+    }
+
+private:
+    uint32_t order(int value) const {
+        uint32_t word = static_cast<uint32_t>(value);
+        return swap ? __builtin_bswap32(word) : word;
+    }
+
+    void flush() {
+        if (in_memory) return;
+        const char *p = reinterpret_cast<const char *>(buffer.data());
+        size_t remaining = buffer.size() * sizeof(uint32_t);
+        while (remaining > 0 && fd >= 0) {
+            ssize_t n = ::write(fd, p, remaining);
+            if (n <= 0) { failed = true; break; }
+            p += n;
+            remaining -= static_cast<size_t>(n);
+        }
+        flushed += buffer.size();
+        buffer.clear();
+    }
+
+    std::vector<uint32_t> buffer;
+    size_t flushed = 0;
+    int fd = -1;
+    bool swap;
+    bool failed = false;
+    bool in_memory = false;
+};
+
 /**
  * How to write raw binary to a file in C++
  */
-void write_binary(int value,std::ofstream &outfile)
+inline void write_binary(int value, WordWriter &outfile)
 {
     //std::cout << std::hex << value << std::endl; //Useful for debugging
-    outfile.write((char *)&value, sizeof(int));
+    outfile.write(value);
 }
 
 /**
@@ -62,55 +490,485 @@ void write_binary(int value,std::ofstream &outfile)
 
 
 // Utility function for encoding an arithmetic "R" type function
-int encode_Rtype(int opcode, int rs, int rt, int rd, int shftamt, int funccode) {
+inline int encode_Rtype(int opcode, int rs, int rt, int rd, int shftamt, int funccode) {
     return (opcode << 26) + (rs << 21) + (rt << 16) + (rd << 11) + (shftamt << 6) + funccode;
 }
 // Hint: What other instruction types need to be encoded?
-int encode_Itype(int opcode, int rs, int rt, int imm) {
+inline int encode_Itype(int opcode, int rs, int rt, int imm) {
     return (opcode << 26) + (rs << 21) + (rt << 16) + (imm & 0xFFFF);
 }
 
-int encode_Jtype(int opcode, int target) {
+inline int encode_Jtype(int opcode, int target) {
     return (opcode << 26) + (target & 0x3FFFFFF);
 }
 
+/**
+ * Instruction fields, structure-of-arrays
+ *
+ * Parsing records each word as its fields, one array per field, and whole
+ * files are encoded at once by encode_fields(). The three formats share
+ * one layout: an I-type word keeps its masked immediate in imm and zero in
+ * rd, shamt and funct; a J-type word keeps its target in imm and zero in
+ * the register fields; an R-type word has imm 0. Every word is then
+ * opcode << 26 | rs << 21 | rt << 16 | rd << 11 | shamt << 6 | funct | imm,
+ * which is what the scalar encoders above compute for in-range fields.
+ */
+struct InstructionFields {
+    enum Format : uint8_t { R, I, J };
+
+    // Only the first size() entries are meaningful; the arrays grow together, ahead of it.
+    std::vector<uint8_t> format, opcode, rs, rt, rd, shamt, funct;
+    std::vector<uint32_t> imm;
+
+    size_t size() const { return count; }
+    void clear() { count = 0; }
+    void reserve(size_t n) { if (n > imm.size()) grow(n); }
+
+    void rtype(int op, int s, int t, int d, int sh, int fn) { push(R, op, s, t, d, sh, fn, 0); }
+    void itype(int op, int s, int t, int immediate) { push(I, op, s, t, 0, 0, 0, immediate & 0xFFFF); }
+    void jtype(int op, int target) { push(J, op, 0, 0, 0, 0, 0, target & 0x3FFFFFF); }
+
+    //Word i as encode_Rtype/encode_Itype/encode_Jtype give it, to check encode_fields() against
+    int reference(size_t i) const {
+        switch (format[i]) {
+            case R: return encode_Rtype(opcode[i], rs[i], rt[i], rd[i], shamt[i], funct[i]);
+            case I: return encode_Itype(opcode[i], rs[i], rt[i], static_cast<int>(imm[i]));
+            default: return encode_Jtype(opcode[i], static_cast<int>(imm[i]));
+        }
+    }
+
+private:
+    void push(Format f, int op, int s, int t, int d, int sh, int fn, int immediate) {
+        if (count == imm.size()) grow(std::max<size_t>(1024, 2 * count));
+        format[count] = f;
+        opcode[count] = static_cast<uint8_t>(op);
+        rs[count] = static_cast<uint8_t>(s);
+        rt[count] = static_cast<uint8_t>(t);
+        rd[count] = static_cast<uint8_t>(d);
+        shamt[count] = static_cast<uint8_t>(sh);
+        funct[count] = static_cast<uint8_t>(fn);
+        imm[count] = static_cast<uint32_t>(immediate);
+        count++;
+    }
+
+    void grow(size_t n) {
+        for (std::vector<uint8_t>* v : {&format, &opcode, &rs, &rt, &rd, &shamt, &funct}) v->resize(n);
+        imm.resize(n);
+    }
+
+    size_t count = 0;
+};
+
+inline void encode_fields_scalar(const InstructionFields& f, size_t first, size_t end, int* out) {
+    for (size_t i = first; i < end; i++) {
+        out[i] = static_cast<int>(uint32_t(f.opcode[i]) << 26 | uint32_t(f.rs[i]) << 21 | uint32_t(f.rt[i]) << 16 |
+                                  uint32_t(f.rd[i]) << 11 | uint32_t(f.shamt[i]) << 6 | f.funct[i] | f.imm[i]);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//Bytes i..i+7 of a field, one per 32-bit lane, shifted into place
+__attribute__((target("avx2"))) inline __m256i field_lanes8(const std::vector<uint8_t>& field, size_t i, int shift) {
+    __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(field.data() + i));
+    return _mm256_sll_epi32(_mm256_cvtepu8_epi32(bytes), _mm_cvtsi32_si128(shift));
+}
+
+__attribute__((target("avx2"))) inline void encode_fields_avx2(const InstructionFields& f, size_t n, int* out) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i word = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(f.imm.data() + i));
+        word = _mm256_or_si256(word, field_lanes8(f.opcode, i, 26));
+        word = _mm256_or_si256(word, field_lanes8(f.rs, i, 21));
+        word = _mm256_or_si256(word, field_lanes8(f.rt, i, 16));
+        word = _mm256_or_si256(word, field_lanes8(f.rd, i, 11));
+        word = _mm256_or_si256(word, field_lanes8(f.shamt, i, 6));
+        word = _mm256_or_si256(word, field_lanes8(f.funct, i, 0));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), word);
+    }
+    encode_fields_scalar(f, i, n, out);
+}
+#endif
+
+#if defined(__SSE2__)
+//Bytes i..i+3 of a field, one per 32-bit lane, shifted into place
+inline __m128i field_lanes4(const std::vector<uint8_t>& field, size_t i, int shift) {
+    int32_t packed;
+    memcpy(&packed, field.data() + i, 4);
+    __m128i zero = _mm_setzero_si128();
+    __m128i lanes = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+    return _mm_sll_epi32(lanes, _mm_cvtsi32_si128(shift));
+}
+
+inline void encode_fields_sse2(const InstructionFields& f, size_t n, int* out) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i word = _mm_loadu_si128(reinterpret_cast<const __m128i*>(f.imm.data() + i));
+        word = _mm_or_si128(word, field_lanes4(f.opcode, i, 26));
+        word = _mm_or_si128(word, field_lanes4(f.rs, i, 21));
+        word = _mm_or_si128(word, field_lanes4(f.rt, i, 16));
+        word = _mm_or_si128(word, field_lanes4(f.rd, i, 11));
+        word = _mm_or_si128(word, field_lanes4(f.shamt, i, 6));
+        word = _mm_or_si128(word, field_lanes4(f.funct, i, 0));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), word);
+    }
+    encode_fields_scalar(f, i, n, out);
+}
+#endif
+
+//Encode every word of f into out[0..f.size()): AVX2 if the CPU has it, else SSE2, else one at a time
+inline void encode_fields(const InstructionFields& f, int* out) {
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2) return encode_fields_avx2(f, f.size(), out);
+#endif
+#if defined(__SSE2__)
+    encode_fields_sse2(f, f.size(), out);
+#else
+    encode_fields_scalar(f, 0, f.size(), out);
+#endif
+}
+
 
 /**
- * Register name map
+ * Opcode table
+ *
+ * Every mnemonic the assembler understands has one entry describing its
+ * format, its opcode/funct pair and the shape of its operand list. Lookup
+ * packs the mnemonic into a 64-bit key and switches on it, so finding an
+ * instruction costs one integer switch instead of a chain of string compares.
  */
-static std::unordered_map<std::string, int> registers {
-  {"$zero", 0}, {"$0", 0},
-  {"$at", 1}, {"$1", 1},
-  {"$v0", 2}, {"$2", 2},
-  {"$v1", 3}, {"$3", 3},
-  {"$a0", 4}, {"$4", 4},
-  {"$a1", 5}, {"$5", 5},
-  {"$a2", 6}, {"$6", 6},
-  {"$a3", 7}, {"$7", 7},
-  {"$t0", 8}, {"$8", 8},
-  {"$t1", 9}, {"$9", 9},
-  {"$t2", 10}, {"$10", 10},
-  {"$t3", 11}, {"$11", 11},
-  {"$t4", 12}, {"$12", 12},
-  {"$t5", 13}, {"$13", 13},
-  {"$t6", 14}, {"$14", 14},
-  {"$t7", 15}, {"$15", 15},
-  {"$s0", 16}, {"$16", 16},
-  {"$s1", 17}, {"$17", 17},
-  {"$s2", 18}, {"$18", 18},
-  {"$s3", 19}, {"$19", 19},
-  {"$s4", 20}, {"$20", 20},
-  {"$s5", 21}, {"$21", 21},
-  {"$s6", 22}, {"$22", 22},
-  {"$s7", 23}, {"$23", 23},
-  {"$t8", 24}, {"$24", 24},
-  {"$t9", 25}, {"$25", 25},
-  {"$k0", 26}, {"$26", 26},
-  {"$k1", 27}, {"$27", 27},
-  {"$gp", 28}, {"$28", 28},
-  {"$sp", 29}, {"$29", 29},
-  {"$s8", 30}, {"$30", 30},
-  {"$ra", 31}, {"$31", 31}
+enum class Format { R, I, J, Pseudo };
+
+// Operand layouts, named in source order.
+enum class Operands {
+    None,        // syscall
+    Rd,          // mfhi $rd
+    Rs,          // jr $rs
+    RsRt,        // mult $rs, $rt
+    RdRs,        // abs $rd, $rs
+    RdRsRt,      // add $rd, $rs, $rt
+    RdRtShamt,   // sll $rd, $rt, shamt
+    RtRsImm,     // addi $rt, $rs, imm
+    RtRsUimm,    // ori $rt, $rs, imm (0 to 0xffff, zero-extended)
+    RtImm,       // lui $rt, imm
+    RtMem,       // lw $rt, imm($rs)
+    RsRtLabel,   // beq $rs, $rt, label
+    Label,       // j label
+    RegLabel,    // la $rt, label
+    Jalr         // jalr $rs  |  jalr $rd, $rs
+};
+
+enum class Op : uint8_t {
+    add, sub, slt, addi, lw, sw, beq, bne, j, jal, jr, jalr, syscall,
+    mult, div, mfhi, mflo, sll, srl, sra, xor_, nor, sltu, xori, ori, andi, lui, sltiu,
+    la, li, sgt, sge, sle, seq, sne, bge, bgt, ble, blt, abs,
+    count
+};
+
+struct OpInfo {
+    const char *mnemonic;
+    Format format;
+    int opcode;
+    int funct;
+    Operands operands;
+    int words;      // most words emitted, before any branch relaxation; some operands need fewer
+};
+
+// Indexed by Op. Pseudo-instructions carry no opcode/funct of their own.
+constexpr OpInfo OPCODES[] = {
+    {"add",     Format::R,      0,  32, Operands::RdRsRt,     1},
+    {"sub",     Format::R,      0,  34, Operands::RdRsRt,     1},
+    {"slt",     Format::R,      0,  42, Operands::RdRsRt,     1},
+    {"addi",    Format::I,      8,  0,  Operands::RtRsImm,    1},
+    {"lw",      Format::I,      35, 0,  Operands::RtMem,      1},
+    {"sw",      Format::I,      43, 0,  Operands::RtMem,      1},
+    {"beq",     Format::I,      4,  0,  Operands::RsRtLabel,  1},
+    {"bne",     Format::I,      5,  0,  Operands::RsRtLabel,  1},
+    {"j",       Format::J,      2,  0,  Operands::Label,      1},
+    {"jal",     Format::J,      3,  0,  Operands::Label,      1},
+    {"jr",      Format::R,      0,  8,  Operands::Rs,         1},
+    {"jalr",    Format::R,      0,  9,  Operands::Jalr,       1},
+    {"syscall", Format::R,      0,  12, Operands::None,       1},
+    {"mult",    Format::R,      0,  24, Operands::RsRt,       1},
+    {"div",     Format::R,      0,  26, Operands::RsRt,       1},
+    {"mfhi",    Format::R,      0,  16, Operands::Rd,         1},
+    {"mflo",    Format::R,      0,  18, Operands::Rd,         1},
+    {"sll",     Format::R,      0,  0,  Operands::RdRtShamt,  1},
+    {"srl",     Format::R,      0,  2,  Operands::RdRtShamt,  1},
+    {"sra",     Format::R,      0,  3,  Operands::RdRtShamt,  1},
+    {"xor",     Format::R,      0,  38, Operands::RdRsRt,     1},
+    {"nor",     Format::R,      0,  39, Operands::RdRsRt,     1},
+    {"sltu",    Format::R,      0,  43, Operands::RdRsRt,     1},
+    {"xori",    Format::I,      14, 0,  Operands::RtRsUimm,   1},
+    {"ori",     Format::I,      13, 0,  Operands::RtRsUimm,   1},
+    {"andi",    Format::I,      12, 0,  Operands::RtRsUimm,   1},
+    {"lui",     Format::I,      15, 0,  Operands::RtImm,      1},
+    {"sltiu",   Format::I,      11, 0,  Operands::RtRsImm,    1},
+    {"la",      Format::Pseudo, 0,  0,  Operands::RegLabel,   2},
+    {"li",      Format::Pseudo, 0,  0,  Operands::RtImm,      2},
+    {"sgt",     Format::Pseudo, 0,  0,  Operands::RdRsRt,     1},
+    {"sge",     Format::Pseudo, 0,  0,  Operands::RdRsRt,     2},
+    {"sle",     Format::Pseudo, 0,  0,  Operands::RdRsRt,     2},
+    {"seq",     Format::Pseudo, 0,  0,  Operands::RdRsRt,     2},
+    {"sne",     Format::Pseudo, 0,  0,  Operands::RdRsRt,     2},
+    {"bge",     Format::Pseudo, 0,  0,  Operands::RsRtLabel,  2},
+    {"bgt",     Format::Pseudo, 0,  0,  Operands::RsRtLabel,  2},
+    {"ble",     Format::Pseudo, 0,  0,  Operands::RsRtLabel,  2},
+    {"blt",     Format::Pseudo, 0,  0,  Operands::RsRtLabel,  2},
+    {"abs",     Format::Pseudo, 0,  0,  Operands::RdRs,       3},
+};
+static_assert(sizeof(OPCODES) / sizeof(OPCODES[0]) == static_cast<size_t>(Op::count),
+              "OPCODES must have one entry per Op");
+
+constexpr const OpInfo &op_info(Op op) {
+    return OPCODES[static_cast<size_t>(op)];
+}
+
+// Number of operands that follow the mnemonic; jalr also accepts one fewer.
+constexpr size_t operand_count(Operands operands) {
+    switch (operands) {
+        case Operands::None:      return 0;
+        case Operands::Rd:
+        case Operands::Rs:
+        case Operands::Label:     return 1;
+        case Operands::RsRt:
+        case Operands::RdRs:
+        case Operands::RegLabel:
+        case Operands::RtImm:
+        case Operands::Jalr:      return 2;
+        default:                  return 3;
+    }
+}
+
+// Pack up to 8 characters into an integer key; longer strings map to 0.
+constexpr uint64_t pack_mnemonic(std::string_view s) {
+    if (s.empty() || s.size() > 8) return 0;
+    uint64_t key = 0;
+    for (char c : s) key = (key << 8) | static_cast<unsigned char>(c);
+    return key;
+}
+
+//Find the opcode table entry for a mnemonic, returns false if there is none
+inline bool lookup_opcode(std::string_view mnemonic, Op &op) {
+    switch (pack_mnemonic(mnemonic)) {
+#define OPCODE_CASE(name) case pack_mnemonic(#name): op = Op::name; return true;
+        OPCODE_CASE(add)  OPCODE_CASE(sub)  OPCODE_CASE(slt)  OPCODE_CASE(addi)
+        OPCODE_CASE(lw)   OPCODE_CASE(sw)   OPCODE_CASE(beq)  OPCODE_CASE(bne)
+        OPCODE_CASE(j)    OPCODE_CASE(jal)  OPCODE_CASE(jr)   OPCODE_CASE(jalr)
+        OPCODE_CASE(syscall) OPCODE_CASE(mult) OPCODE_CASE(div)
+        OPCODE_CASE(mfhi) OPCODE_CASE(mflo) OPCODE_CASE(sll)  OPCODE_CASE(srl)
+        OPCODE_CASE(sra)  OPCODE_CASE(nor)  OPCODE_CASE(sltu) OPCODE_CASE(xori)
+        OPCODE_CASE(ori)  OPCODE_CASE(andi) OPCODE_CASE(lui)  OPCODE_CASE(sltiu)
+        OPCODE_CASE(la)   OPCODE_CASE(li)   OPCODE_CASE(sgt)  OPCODE_CASE(sge)  OPCODE_CASE(sle)
+        OPCODE_CASE(seq)  OPCODE_CASE(sne)  OPCODE_CASE(bge)  OPCODE_CASE(bgt)
+        OPCODE_CASE(ble)  OPCODE_CASE(blt)  OPCODE_CASE(abs)
+#undef OPCODE_CASE
+        case pack_mnemonic("xor"): op = Op::xor_; return true;  // xor is an operator name in C++
+        default: return false;
+    }
+}
+
+
+/**
+ * Operand lexer
+ *
+ * Registers, immediates and labels are told apart by their first character
+ * and decoded in place, without allocating or throwing.
+ */
+constexpr std::string_view REGISTER_NAMES[32] = {
+    "$zero", "$at", "$v0", "$v1", "$a0", "$a1", "$a2", "$a3",
+    "$t0", "$t1", "$t2", "$t3", "$t4", "$t5", "$t6", "$t7",
+    "$s0", "$s1", "$s2", "$s3", "$s4", "$s5", "$s6", "$s7",
+    "$t8", "$t9", "$k0", "$k1", "$gp", "$sp", "$s8", "$ra"
+};
+
+// Register names packed like mnemonics, indexed by register number.
+struct RegisterTable {
+    uint64_t key[32];
+    constexpr RegisterTable() : key() {
+        for (int r = 0; r < 32; r++) key[r] = pack_mnemonic(REGISTER_NAMES[r]);
+    }
+};
+constexpr RegisterTable REGISTER_TABLE;
+
+//Decode "$name" or "$N" (0 to 31) into a register number, returns false if s is neither
+constexpr bool parse_register(std::string_view s, int &reg) {
+    if (s.size() < 2 || s[0] != '$') return false;
+    if (s[1] >= '0' && s[1] <= '9') {
+        if (s.size() > 3 || (s.size() == 3 && (s[1] == '0' || s[2] < '0' || s[2] > '9'))) return false;
+        int n = s[1] - '0';
+        if (s.size() == 3) n = n * 10 + (s[2] - '0');
+        if (n > 31) return false;
+        reg = n;
+        return true;
+    }
+    uint64_t key = pack_mnemonic(s);
+    if (key == pack_mnemonic("$fp")) key = pack_mnemonic("$s8");
+    for (int r = 0; r < 32; r++) {
+        if (REGISTER_TABLE.key[r] == key) {
+            reg = r;
+            return true;
+        }
+    }
+    return false;
+}
+
+constexpr int register_number(std::string_view s) {
+    int reg = -1;
+    return parse_register(s, reg) ? reg : -1;
+}
+static_assert(register_number("$zero") == 0 && register_number("$ra") == 31 && register_number("$29") == 29 &&
+              register_number("$fp") == 30 && register_number("$32") == -1 && register_number("$t10") == -1,
+              "register decoder is broken");
+
+//Parse a decimal or 0x hex integer with an optional sign; returns false unless all of s is
+//a number in 32 bits (signed or unsigned, so 0xFFFFFFFF is -1)
+inline bool parse_immediate(std::string_view s, int &value) {
+    bool negative = !s.empty() && s[0] == '-';
+    if (!s.empty() && (s[0] == '-' || s[0] == '+')) s.remove_prefix(1);
+    int base = 10;
+    if (s.size() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        s.remove_prefix(2);
+        base = 16;
+    }
+    if (s.empty() || s[0] == '-' || s[0] == '+') return false;
+    uint64_t magnitude = 0;
+    auto result = std::from_chars(s.data(), s.data() + s.size(), magnitude, base);
+    if (result.ec != std::errc() || result.ptr != s.data() + s.size()) return false;
+    if (negative ? magnitude > 0x80000000u : magnitude > 0xFFFFFFFFu) return false;
+    value = static_cast<int>(static_cast<uint32_t>(negative ? 0 - magnitude : magnitude));
+    return true;
+}
+
+//A label is a letter, '_' or '.' followed by letters, digits, '_' or '.'
+constexpr bool is_label(std::string_view s) {
+    if (s.empty() || (s[0] >= '0' && s[0] <= '9')) return false;
+    for (char c : s) {
+        bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '.';
+        if (!ok) return false;
+    }
+    return true;
+}
+
+
+/**
+ * Symbol table
+ *
+ * Label names are copied once into an arena and referred to by small
+ * integer ids, in the order they were first seen. Names are found through
+ * a flat open-addressing table of ids with linear probing, kept at most
+ * half full. All of it is freed at once with the table, and clear() keeps
+ * the memory for the next file.
+ */
+class Arena {
+public:
+    static constexpr size_t BLOCK_BYTES = 64 << 10;
+
+    //Copy s into the arena; the copy lives until clear() or destruction
+    std::string_view copy(std::string_view s) {
+        if (s.size() > BLOCK_BYTES / 4) {
+            large.emplace_back(new char[s.size()]);
+            memcpy(large.back().get(), s.data(), s.size());
+            return std::string_view(large.back().get(), s.size());
+        }
+        if (blocks.empty() || used + s.size() > BLOCK_BYTES) {
+            if (blocks.empty() || ++current == blocks.size()) {
+                blocks.emplace_back(new char[BLOCK_BYTES]);
+                current = blocks.size() - 1;
+            }
+            used = 0;
+        }
+        char *p = blocks[current].get() + used;
+        memcpy(p, s.data(), s.size());
+        used += s.size();
+        return std::string_view(p, s.size());
+    }
+
+    void clear() {
+        large.clear();
+        current = 0;
+        used = 0;
+    }
+
+private:
+    std::vector<std::unique_ptr<char[]>> blocks;
+    std::vector<std::unique_ptr<char[]>> large; // strings bigger than a quarter block
+    size_t current = 0;
+    size_t used = 0;
+};
+
+enum class Section : uint8_t { None, Text, Data };
+
+struct Symbol {
+    std::string_view name;           // points into the table's arena
+    uint32_t hash;
+    Section section = Section::None; // None until the label is defined
+    bool global = false;             // named by .globl
+    int value = 0;                   // word index (text) or byte offset (data)
+
+    bool defined() const { return section != Section::None; }
+};
+
+class SymbolTable {
+public:
+    //Id of name, adding it as an undefined symbol if it is new
+    int intern(std::string_view name) {
+        if (symbols.size() * 2 >= slots.size()) grow();
+        uint32_t hash = static_cast<uint32_t>(hash_bytes(name));
+        size_t slot = probe(name, hash);
+        if (slots[slot] < 0) {
+            slots[slot] = static_cast<int32_t>(symbols.size());
+            symbols.push_back({arena.copy(name), hash});
+        }
+        return slots[slot];
+    }
+
+    //Id of name, or -1 if it is not in the table
+    int find(std::string_view name) const {
+        if (slots.empty()) return -1;
+        return slots[probe(name, static_cast<uint32_t>(hash_bytes(name)))];
+    }
+
+    Symbol &operator[](int id) { return symbols[static_cast<size_t>(id)]; }
+    const Symbol &operator[](int id) const { return symbols[static_cast<size_t>(id)]; }
+    size_t size() const { return symbols.size(); }
+    size_t slot_count() const { return slots.size(); }
+    float load_factor() const { return slots.empty() ? 0.0f : static_cast<float>(symbols.size()) / slots.size(); }
+    std::vector<Symbol>::const_iterator begin() const { return symbols.begin(); }
+    std::vector<Symbol>::const_iterator end() const { return symbols.end(); }
+
+    void clear() {
+        symbols.clear();
+        std::fill(slots.begin(), slots.end(), -1);
+        arena.clear();
+    }
+
+private:
+    //Slot holding name, or the empty slot where it would go
+    size_t probe(std::string_view name, uint32_t hash) const {
+        size_t mask = slots.size() - 1;
+        for (size_t slot = hash & mask; ; slot = (slot + 1) & mask) {
+            int32_t id = slots[slot];
+            if (id < 0) return slot;
+            const Symbol &symbol = symbols[static_cast<size_t>(id)];
+            if (symbol.hash == hash && symbol.name == name) return slot;
+        }
+    }
+
+    void grow() {
+        std::vector<int32_t> old(std::max<size_t>(16, slots.size() * 2), -1);
+        old.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (size_t id = 0; id < symbols.size(); id++) {
+            size_t slot = symbols[id].hash & mask;
+            while (slots[slot] >= 0) slot = (slot + 1) & mask;
+            slots[slot] = static_cast<int32_t>(id);
+        }
+    }
+
+    std::vector<Symbol> symbols;
+    std::vector<int32_t> slots; // symbol id, or -1 for an empty slot
+    Arena arena;
 };
 
 
@@ -1,19 +1,445 @@
 //This program will read a file and output the binary in that file to the
-//terminal, 32 bits at a time. It prints in binary, hex, and decimal
-#include <string>
-#include <iostream>
-#include <fstream>
-#include <bitset>
-#include <iomanip>
-
-int main(int argc, char* argv[]) {
-  std::string filename = argv[argc-1];
-  int buffer;
-  std::ifstream file(filename, std::ios::in | std::ios::binary);
-  while(file.read((char*) &buffer,sizeof(int))) {
-    std::cout << std::bitset<32>(buffer) << " " << std::setfill('0') <<
-std::setw(8) << std::hex << buffer << " " << std::dec << buffer << std::endl;
-  }
-  file.close();
-  
-}
\ No newline at end of file
+//terminal, 32 bits at a time. By default it prints each word in binary, hex,
+//and decimal; with -d it disassembles an instructions file or container made
+//by assemble, with a label at every branch and jump target.
+#include "project1.h"
+#include "container.h"
+
+#include <array>
+#include <atomic>
+#include <thread>
+
+/**
+ * Decode table
+ *
+ * Instructions are found by opcode, and R-type instructions by funct. The
+ * table is filled from the assembler's own OPCODES table. Pseudo-instruction
+ * expansions only use native instructions, so every word assemble emits
+ * decodes back to a mnemonic.
+ */
+enum class Shape {
+    Unknown,
+    None,        // syscall
+    Rd,          // mfhi $rd
+    Rs,          // jr $rs
+    RsRt,        // mult $rs, $rt
+    RdRsRt,      // add $rd, $rs, $rt
+    RdRtShamt,   // sll $rd, $rt, shamt
+    RtRsImm,     // addi $rt, $rs, imm
+    RtRsUimm,    // ori $rt, $rs, 0xffff
+    RtUimm,      // lui $rt, 0xffff
+    RtMem,       // lw $rt, imm($rs)
+    Branch,      // beq $rs, $rt, label
+    Jump,        // j label
+    Jalr         // jalr $rs  |  jalr $rd, $rs
+};
+
+// The mnemonic is kept zero-padded to 8 bytes so it can be copied whole.
+struct Form {
+    char mnemonic[8] = {};
+    uint8_t length = 0;
+    Shape shape = Shape::Unknown;
+};
+
+Shape shape_of(Operands operands) {
+    switch (operands) {
+        case Operands::None:      return Shape::None;
+        case Operands::Rd:        return Shape::Rd;
+        case Operands::Rs:        return Shape::Rs;
+        case Operands::RsRt:      return Shape::RsRt;
+        case Operands::RdRsRt:    return Shape::RdRsRt;
+        case Operands::RdRtShamt: return Shape::RdRtShamt;
+        case Operands::RtRsImm:   return Shape::RtRsImm;
+        case Operands::RtRsUimm:  return Shape::RtRsUimm;
+        case Operands::RtImm:     return Shape::RtUimm;
+        case Operands::RtMem:     return Shape::RtMem;
+        case Operands::RsRtLabel: return Shape::Branch;
+        case Operands::Label:     return Shape::Jump;
+        case Operands::Jalr:      return Shape::Jalr;
+        default:                  return Shape::Unknown;  // pseudo-instruction layouts
+    }
+}
+
+class DecodeTable {
+public:
+    DecodeTable() {
+        for (const OpInfo &info : OPCODES) {
+            if (info.format == Format::Pseudo) continue;
+            set(slot(info.format, info.opcode, info.funct), info.mnemonic, shape_of(info.operands));
+        }
+    }
+
+    const Form &lookup(uint32_t word) const {
+        uint32_t opcode = word >> 26;
+        return opcode == 0 ? special[word & 63] : primary[opcode];
+    }
+
+private:
+    static void set(Form &form, std::string_view mnemonic, Shape shape) {
+        memcpy(form.mnemonic, mnemonic.data(), std::min<size_t>(mnemonic.size(), 8));
+        form.length = static_cast<uint8_t>(std::min<size_t>(mnemonic.size(), 8));
+        form.shape = shape;
+    }
+
+    Form &slot(Format format, int opcode, int funct) {
+        return format == Format::R ? special[funct & 63] : primary[opcode & 63];
+    }
+
+    Form primary[64];  // by opcode
+    Form special[64];  // opcode 0, by funct
+};
+
+/**
+ * The input file, viewed in place as 32-bit words in the given byte order.
+ * A trailing partial word is ignored.
+ */
+class WordView {
+public:
+    WordView(std::string_view bytes, Endian endian)
+        : data(bytes.data()), count(bytes.size() / 4), swap(endian != host_endian()) {}
+
+    uint32_t operator[](size_t i) const {
+        uint32_t word;
+        memcpy(&word, data + 4 * i, 4);
+        return swap ? __builtin_bswap32(word) : word;
+    }
+    size_t size() const { return count; }
+
+private:
+    const char *data;
+    size_t count;
+    bool swap;
+};
+
+//Instruction index a branch or jump goes to, or -1 if the word is neither
+int64_t target_of(const Form &form, uint32_t word, size_t index) {
+    if (form.shape == Shape::Branch) return static_cast<int64_t>(index) + 1 + static_cast<int16_t>(word & 0xFFFF);
+    if (form.shape == Shape::Jump) return word & 0x3FFFFFF;
+    return -1;
+}
+
+/**
+ * Output formatting
+ *
+ * Lines are formatted straight into a block buffer through a cursor, with
+ * room for the longest possible line checked once per word instead of on
+ * every append. Each block is formatted on its own, so blocks can be
+ * formatted on several threads and written out in order with one write(2)
+ * each.
+ */
+inline char *put(char *p, std::string_view s) {
+    memcpy(p, s.data(), s.size());
+    return p + s.size();
+}
+
+//String literals are copied with a length known at compile time
+template <size_t N>
+inline char *put(char *p, const char (&s)[N]) {
+    memcpy(p, s, N - 1);
+    return p + N - 1;
+}
+
+//Write the low `digits` hex digits of value, zero-filled and in lowercase
+inline char *put_hex(char *p, uint32_t value, int digits = 8) {
+    static const char DIGITS[] = "0123456789abcdef";
+    for (int i = digits - 1; i >= 0; i--, value >>= 4) p[i] = DIGITS[value & 15];
+    return p + digits;
+}
+
+inline char *put_decimal(char *p, int64_t value) {
+    return std::to_chars(p, p + 24, value).ptr;
+}
+
+// Register names padded to 8 bytes, so each is written with one fixed-size copy.
+struct RegisterText {
+    char text[8];
+    size_t length;
+};
+
+const std::array<RegisterText, 32> REGISTER_TEXT = []() {
+    std::array<RegisterText, 32> table {};
+    for (size_t r = 0; r < 32; r++) {
+        memcpy(table[r].text, REGISTER_NAMES[r].data(), REGISTER_NAMES[r].size());
+        table[r].length = REGISTER_NAMES[r].size();
+    }
+    return table;
+}();
+
+inline char *put_register(char *p, uint32_t r) {
+    const RegisterText &name = REGISTER_TEXT[r & 31];
+    memcpy(p, name.text, 8);
+    return p + name.length;
+}
+
+/**
+ * Labels of the instruction file, one entry per word: none, a name made up
+ * from the address, or a name from a symbol map (assemble --map) or from
+ * the symbol table of a container.
+ */
+class Labels {
+public:
+    static constexpr int32_t NONE = -1;
+    static constexpr int32_t SYNTHETIC = -2;
+
+    explicit Labels(size_t words) : label(words, NONE) {}
+
+    void mark(int64_t index) {
+        if (index >= 0 && static_cast<size_t>(index) < label.size() && label[index] == NONE) label[index] = SYNTHETIC;
+    }
+    bool has(int64_t index) const {
+        return index >= 0 && static_cast<size_t>(index) < label.size() && label[index] != NONE;
+    }
+
+    //Read the text symbols of a map file written by assemble --map
+    bool load_map(const char *path) {
+        MappedFile file(path);
+        if (!file.ok()) return false;
+        std::string_view text = file.contents();
+        for (size_t pos = 0; pos < text.size(); ) {
+            Terms fields = split(next_line(text, pos), WHITESPACE);
+            int address;
+            if (fields.size() == 3 && fields[0] == "text" && parse_immediate(fields[1], address) && address >= 0) {
+                add(static_cast<uint32_t>(address), fields[2]);
+            }
+        }
+        return true;
+    }
+
+    //Take the text symbols of a container
+    void load_symbols(const ContainerView &program) {
+        for (size_t i = 0; i < program.symbol_count(); i++) {
+            ContainerView::SymbolRecord symbol = program.symbol(i);
+            if (symbol.section == Section::Text) add(symbol.address, symbol.name);
+        }
+    }
+
+    //Write the label of word index
+    char *put_name(char *p, size_t index) const {
+        if (label[index] >= 0) return put(p, names[label[index]]);
+        return put_hex(put(p, "L_"), static_cast<uint32_t>(4 * index));
+    }
+
+    size_t longest_name() const { return longest; }
+
+private:
+    //Name the word at a byte address; the first name given for a word stays
+    void add(uint32_t address, std::string_view name) {
+        size_t index = address / 4;
+        if (address % 4 || index >= label.size() || label[index] >= 0) return;
+        label[index] = static_cast<int32_t>(names.size());
+        names.emplace_back(name);
+        longest = std::max(longest, name.size());
+    }
+
+    std::vector<int32_t> label;
+    std::vector<std::string> names;
+    size_t longest = 10;  // L_ and eight hex digits
+};
+
+const char BITS[16][5] = {
+    "0000", "0001", "0010", "0011", "0100", "0101", "0110", "0111",
+    "1000", "1001", "1010", "1011", "1100", "1101", "1110", "1111"
+};
+
+//The original output: binary, hex and signed decimal, one word per line
+char *format_dump(const WordView &words, size_t begin, size_t end, char *p) {
+    for (size_t i = begin; i < end; i++) {
+        uint32_t word = words[i];
+        for (int nibble = 0; nibble < 8; nibble++) memcpy(p + 4 * nibble, BITS[(word >> (28 - 4 * nibble)) & 15], 4);
+        p[32] = ' ';
+        p = put_hex(p + 33, word);
+        *p++ = ' ';
+        p = put_decimal(p, static_cast<int32_t>(word));
+        *p++ = '\n';
+    }
+    return p;
+}
+
+char *format_instruction(const Form &form, uint32_t word, size_t index, const Labels &labels, char *p) {
+    uint32_t rs = (word >> 21) & 31, rt = (word >> 16) & 31, rd = (word >> 11) & 31;
+    int32_t simm = static_cast<int16_t>(word & 0xFFFF);
+    auto sep = [&]() { p = put(p, ", "); };
+
+    if (form.shape == Shape::Unknown) return put_hex(put(p, ".word 0x"), word);
+    memcpy(p, form.mnemonic, 8);
+    p += form.length;
+    if (form.shape != Shape::None) *p++ = ' ';
+    switch (form.shape) {
+        case Shape::Unknown:
+        case Shape::None:
+            break;
+        case Shape::Rd:
+            p = put_register(p, rd);
+            break;
+        case Shape::Rs:
+            p = put_register(p, rs);
+            break;
+        case Shape::RsRt:
+            p = put_register(p, rs); sep(); p = put_register(p, rt);
+            break;
+        case Shape::RdRsRt:
+            p = put_register(p, rd); sep(); p = put_register(p, rs); sep(); p = put_register(p, rt);
+            break;
+        case Shape::RdRtShamt:
+            p = put_register(p, rd); sep(); p = put_register(p, rt); sep(); p = put_decimal(p, (word >> 6) & 31);
+            break;
+        case Shape::RtRsImm:
+            p = put_register(p, rt); sep(); p = put_register(p, rs); sep(); p = put_decimal(p, simm);
+            break;
+        case Shape::RtRsUimm:
+            p = put_register(p, rt); sep(); p = put_register(p, rs); sep();
+            p = put_hex(put(p, "0x"), word & 0xFFFF, 4);
+            break;
+        case Shape::RtUimm:
+            p = put_register(p, rt); sep();
+            p = put_hex(put(p, "0x"), word & 0xFFFF, 4);
+            break;
+        case Shape::RtMem:
+            p = put_register(p, rt); sep(); p = put_decimal(p, simm);
+            *p++ = '('; p = put_register(p, rs); *p++ = ')';
+            break;
+        case Shape::Branch:
+        case Shape::Jump: {
+            if (form.shape == Shape::Branch) {
+                p = put_register(p, rs); sep(); p = put_register(p, rt); sep();
+            }
+            int64_t target = target_of(form, word, index);
+            if (labels.has(target)) {
+                p = labels.put_name(p, static_cast<size_t>(target));
+            } else {
+                p = put_decimal(p, form.shape == Shape::Branch ? simm : target);
+            }
+            break;
+        }
+        case Shape::Jalr:
+            if (rd != 31) { p = put_register(p, rd); sep(); }
+            p = put_register(p, rs);
+            break;
+    }
+    return p;
+}
+
+//One line per instruction: byte address, the word in hex, then the instruction
+char *format_disassembly(const WordView &words, const DecodeTable &table, const Labels &labels,
+                         size_t begin, size_t end, char *p) {
+    for (size_t i = begin; i < end; i++) {
+        if (labels.has(static_cast<int64_t>(i))) p = put(labels.put_name(p, i), ":\n");
+        uint32_t word = words[i];
+        p = put_hex(put(p, "  "), static_cast<uint32_t>(4 * i));
+        p = put_hex(put(p, ":  "), word);
+        p = format_instruction(table.lookup(word), word, i, labels, put(p, "  "));
+        *p++ = '\n';
+    }
+    return p;
+}
+
+bool write_all(int fd, const char *p, size_t remaining) {
+    while (remaining > 0) {
+        ssize_t n = ::write(fd, p, remaining);
+        if (n <= 0) return false;
+        p += n;
+        remaining -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    Endian endian = Endian::Little;
+    bool disassemble = false;
+    size_t threads = 1;
+    const char* map_path = nullptr;
+    const char* filename = nullptr;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-d") disassemble = true;
+        else if (arg == "-EB") endian = Endian::Big;
+        else if (arg == "-EL") endian = Endian::Little;
+        else if (arg.compare(0, 2, "-j") == 0 && arg.size() > 2) threads = std::max(1, std::atoi(arg.c_str() + 2));
+        else if (arg == "--map" && i + 1 < argc) map_path = argv[++i];
+        else filename = argv[i];
+    }
+    if (!filename)
+    {
+        std::cerr
+            << "Expected Usage:\n"
+            << "  ./readbytes [-d] [-EL|-EB] [-jN] [--map file.map] file.bin\n"
+            << "  Prints each 32-bit word in binary, hex and decimal\n"
+            << "  -d              disassemble an instructions file or container instead\n"
+            << "  -jN             format the output on N threads\n"
+            << "  --map file.map  name labels from a symbol map written by assemble --map\n";
+        exit(1);
+    }
+
+    MappedFile file(filename);
+    if (!file.ok())
+    {
+        std::cerr << "Error: could not read " << filename << std::endl;
+        exit(1);
+    }
+    // A container is disassembled from its text section, in its own byte order.
+    std::string_view bytes = file.contents();
+    ContainerView program(bytes);
+    if (disassemble && program.ok())
+    {
+        bytes = program.section(SectionKind::Text);
+        endian = program.endian();
+    }
+    WordView words(bytes, endian);
+
+    DecodeTable table;
+    Labels labels(disassemble ? words.size() : 0);
+    if (disassemble)
+    {
+        if (map_path && !labels.load_map(map_path))
+        {
+            std::cerr << "Error: could not read symbol map " << map_path << std::endl;
+            exit(1);
+        }
+        if (program.ok()) labels.load_symbols(program);
+        for (size_t i = 0; i < words.size(); i++)
+        {
+            uint32_t word = words[i];
+            labels.mark(target_of(table.lookup(word), word, i));
+        }
+    }
+
+    // Blocks are handed out a round at a time, one per thread, and each
+    // round is written before the next starts, so memory stays bounded.
+    // A disassembly line is at most 64 characters plus a label name, and a
+    // word can also carry a label line of its own.
+    const size_t BLOCK_WORDS = 1 << 15;
+    size_t line_bytes = disassemble ? 72 + 2 * (labels.longest_name() + 2) : 64;
+    size_t blocks = (words.size() + BLOCK_WORDS - 1) / BLOCK_WORDS;
+    std::vector<std::unique_ptr<char[]>> output(threads);
+    std::vector<size_t> output_size(threads);
+    for (size_t first = 0; first < blocks; first += threads)
+    {
+        size_t round = std::min(threads, blocks - first);
+        std::atomic<size_t> next_block {0};
+        auto worker = [&]()
+        {
+            for (size_t b; (b = next_block++) < round; )
+            {
+                size_t begin = (first + b) * BLOCK_WORDS;
+                size_t end = std::min(begin + BLOCK_WORDS, words.size());
+                if (!output[b]) output[b].reset(new char[BLOCK_WORDS * line_bytes]);
+                char *p = output[b].get();
+                char *q = disassemble ? format_disassembly(words, table, labels, begin, end, p)
+                                      : format_dump(words, begin, end, p);
+                output_size[b] = static_cast<size_t>(q - p);
+            }
+        };
+        std::vector<std::thread> workers;
+        for (size_t t = 1; t < round; t++) workers.emplace_back(worker);
+        worker();
+        for (std::thread& t : workers) t.join();
+
+        for (size_t b = 0; b < round; b++)
+        {
+            if (!write_all(1, output[b].get(), output_size[b])) return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,147 @@
+//This program checks what the gold binaries cannot: that every encoder
+//of the instruction field IR gives the words the scalar reference gives,
+//including the scalar tails after the last whole vector, that files cut
+//into chunks for parallel assembly come out as they do in one piece, and
+//that libassemble reports labels nothing defines.
+//"make test" builds it with the standard library's assertions on and runs it.
+#include "project1.h"
+#include "libassemble.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+int failures = 0;
+
+void check(bool ok, const std::string& what)
+{
+    if (ok) return;
+    std::cerr << "FAIL " << what << std::endl;
+    failures++;
+}
+
+//Random in-range fields of every format
+void fill_fields(InstructionFields& fields, std::size_t n, std::mt19937& rng)
+{
+    auto bits = [&](int width) { return static_cast<int>(rng() & ((1u << width) - 1)); };
+    fields.clear();
+    for (std::size_t i = 0; i < n; i++)
+    {
+        switch (rng() % 3)
+        {
+            case 0: fields.rtype(0, bits(5), bits(5), bits(5), bits(5), bits(6)); break;
+            case 1: fields.itype(1 + bits(6) % 63, bits(5), bits(5), static_cast<int>(rng())); break;
+            default: fields.jtype(2 + bits(1), bits(26)); break;
+        }
+    }
+}
+
+void compare(const char* encoder, const InstructionFields& fields, const std::vector<int>& words)
+{
+    for (std::size_t i = 0; i < fields.size(); i++)
+    {
+        if (words[i] == fields.reference(i)) continue;
+        check(false, std::string(encoder) + ": word " + std::to_string(i) + " of " + std::to_string(fields.size()) +
+                     " is " + std::to_string(words[i]) + ", the reference gives " + std::to_string(fields.reference(i)));
+        return;
+    }
+}
+
+void test_encoders()
+{
+    std::mt19937 rng(20);
+    InstructionFields fields;
+    for (std::size_t n : {0, 1, 2, 3, 4, 5, 7, 8, 9, 12, 15, 16, 17, 31, 33, 100, 1023, 1025, 4099})
+    {
+        fill_fields(fields, n, rng);
+        std::vector<int> words(n);
+        encode_fields_scalar(fields, 0, n, words.data());
+        compare("encode_fields_scalar", fields, words);
+#if defined(__SSE2__)
+        std::fill(words.begin(), words.end(), 0);
+        encode_fields_sse2(fields, n, words.data());
+        compare("encode_fields_sse2", fields, words);
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+        if (__builtin_cpu_supports("avx2"))
+        {
+            std::fill(words.begin(), words.end(), 0);
+            encode_fields_avx2(fields, n, words.data());
+            compare("encode_fields_avx2", fields, words);
+        }
+#endif
+        std::fill(words.begin(), words.end(), 0);
+        encode_fields(fields, words.data());
+        compare("encode_fields", fields, words);
+    }
+}
+
+/**
+ * Sources big enough to be cut into chunks, whose lines make the cuts land
+ * in awkward places: a last line with no newline that is longer than every
+ * chunk, so an early chunk runs to the end of the file, and a long line in
+ * the middle. Each must assemble as it does on one thread.
+ */
+void test_chunks()
+{
+    const std::string program = "main:\n    addi $t0, $0, 1\n    addi $v0, $0, 10\n    syscall\n";
+    const std::string long_comment = "#" + std::string(3 << 20, 'x');
+    std::vector<std::pair<std::string, std::string>> cases = {
+        {"long last line", program + long_comment},
+        {"long last line ending in a newline", program + long_comment + "\n"},
+        {"long middle line", program + long_comment + "\nend:\n    addi $t1, $0, 2\n"},
+    };
+    for (const auto& c : cases)
+    {
+        AssemblerOptions options;
+        AssemblerOutput serial = assemble_program({{"chunks.asm", c.second}}, options);
+        check(serial.ok() && !serial.instructions.empty(), c.first + ": assembles on one thread");
+        for (unsigned threads : {2u, 3u, 8u})
+        {
+            options.threads = threads;
+            AssemblerOutput parallel = assemble_program({{"chunks.asm", c.second}}, options);
+            check(parallel.ok() && parallel.instructions == serial.instructions && parallel.static_memory == serial.static_memory,
+                  c.first + ": same words on " + std::to_string(threads) + " threads");
+        }
+    }
+}
+
+//Every use of a label nothing defines is an error, with its line when it is in the text.
+//The command line, --batch and --serve report them through the same run_job.
+void test_undefined_labels()
+{
+    std::string first = "main:\n    j nowhere\n    beq $t0, $0, elsewhere\n    la $t1, other\n    jal shared\n";
+    std::string second = ".data\ntable: .word missing, 7\n.text\nshared:\n    jr $ra\n";
+    AssemblerOutput output = assemble_program({{"first.asm", first}, {"second.asm", second}});
+    std::vector<std::string> expected = {
+        "first.asm:2: error: undefined label: nowhere",
+        "first.asm:3: error: undefined label: elsewhere",
+        "first.asm:4: error: undefined label: other",
+        "second.asm: error: undefined label: missing",
+    };
+    std::vector<std::string> errors;
+    for (const AssemblerError& error : output.errors) errors.push_back(format_error(error));
+    std::sort(errors.begin(), errors.end());
+    check(!output.ok() && output.instructions.empty() && output.static_memory.empty(), "undefined labels fail the program");
+    check(errors == expected, "undefined labels are reported once each, where they are used");
+
+    output = assemble_program({{"first.asm", "main:\n    jal shared\n"}, {"second.asm", second.substr(second.find(".text"))}});
+    check(output.ok(), "a label defined in another source is not undefined");
+}
+
+int main()
+{
+    test_encoders();
+    test_chunks();
+    test_undefined_labels();
+    if (failures)
+    {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "selftest ok" << std::endl;
+    return 0;
+}
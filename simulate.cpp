@@ -0,0 +1,169 @@
+//This program runs a program produced by assemble: it loads the static
+//memory and instruction files and executes them, then reports how many
+//instructions ran and how fast.
+#include "simulator.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/**
+ * Counts how many times each instruction ran, for --profile.
+ */
+struct ProfileTrace
+{
+    std::vector<uint64_t>& counts;
+
+    void fetch(uint32_t pc)
+    {
+        if (pc / 4 < counts.size()) counts[pc / 4]++;
+    }
+    void load(uint32_t, uint32_t) {}
+    void store(uint32_t, uint32_t) {}
+};
+
+//Text labels of a program container, as (byte address, name), named "file:label" by the line map where it can
+bool container_labels(const char* path, std::vector<std::pair<uint32_t, std::string>>& labels)
+{
+    MappedFile file(path);
+    ContainerView program(file.contents());
+    if (!file.ok() || !program.ok()) return false;
+    for (size_t i = 0; i < program.symbol_count(); i++)
+    {
+        ContainerView::SymbolRecord symbol = program.symbol(i);
+        if (symbol.section != Section::Text) continue;
+        ContainerView::LineRecord line;
+        std::string name(symbol.name);
+        if (program.line_of(symbol.address / 4, line) && !line.file.empty()) name = std::string(line.file) + ":" + name;
+        labels.emplace_back(symbol.address, name);
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    Endian endian = Endian::Little;
+    size_t memory_bytes = 16 << 20;
+    uint64_t max_instructions = 0;
+    bool dump_registers = false;
+    const char* profile_path = nullptr;
+    const char* map_path = nullptr;
+    std::vector<const char*> files;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-EB") endian = Endian::Big;
+        else if (arg == "-EL") endian = Endian::Little;
+        else if (arg == "--memory" && i + 1 < argc) memory_bytes = std::strtoull(argv[++i], nullptr, 0);
+        else if (arg == "--max" && i + 1 < argc) max_instructions = std::strtoull(argv[++i], nullptr, 0);
+        else if (arg == "--regs") dump_registers = true;
+        else if (arg == "--profile" && i + 1 < argc) profile_path = argv[++i];
+        else if (arg == "--map" && i + 1 < argc) map_path = argv[++i];
+        else files.push_back(argv[i]);
+    }
+
+    bool labels_known = files.size() == 1 || map_path;
+    if (files.empty() || files.size() > 2 || memory_bytes < 4 || memory_bytes > 0xFFFFFFF0u || (profile_path && !labels_known))
+    {
+        std::cerr
+            << "Expected Usage:\n"
+            << "  ./simulate [-EL|-EB] [--memory bytes] [--max n] [--regs] [--profile file --map file] "
+            << "staticmem_file.bin instructions_file.bin\n"
+            << "  ./simulate [--memory bytes] [--max n] [--regs] [--profile file] program.bin\n"
+            << "  program.bin is a container written by assemble --container, which names its own byte order\n"
+            << "  --memory bytes  size of data memory; $sp starts at its top (default 16 MiB)\n"
+            << "  --max n         stop after n instructions\n"
+            << "  --regs          print the registers when the program stops\n"
+            << "  --profile file  write how many times each text label was reached, for assemble --profile;\n"
+            << "                  labels of a container are written as file:label, those of a map bare\n"
+            << "  --map file      symbol map from assemble --map; labels of a container come with it\n";
+        exit(1);
+    }
+
+    std::vector<uint32_t> static_memory, text;
+    bool loaded = files.size() == 1 ? read_container(files[0], text, static_memory)
+                                    : read_words(files[0], endian, static_memory) && read_words(files[1], endian, text);
+    if (!loaded)
+    {
+        std::cerr << "Error: could not read input files" << std::endl;
+        exit(1);
+    }
+    if (static_memory.size() * 4 > memory_bytes)
+    {
+        std::cerr << "Error: static memory does not fit in " << memory_bytes << " bytes" << std::endl;
+        exit(1);
+    }
+
+    std::vector<std::pair<uint32_t, std::string>> labels;
+    if (profile_path && map_path)
+    {
+        std::ifstream map(map_path);
+        if (!map)
+        {
+            std::cerr << "Error: could not open symbol map: " << map_path << std::endl;
+            exit(1);
+        }
+        std::string section, name;
+        uint32_t address;
+        while (map >> section >> address >> name)
+        {
+            if (section == "text") labels.emplace_back(address, name);
+        }
+    }
+    else if (profile_path) container_labels(files[0], labels);
+
+    Machine machine(text, static_memory, memory_bytes);
+    std::vector<uint64_t> counts(profile_path ? text.size() : 0);
+    ProfileTrace trace {counts};
+    RunResult result = profile_path ? machine.run(trace, max_instructions) : machine.run(max_instructions);
+    std::cout.flush();
+
+    switch (result.status)
+    {
+        case RunResult::Exited:  std::cerr << "Program exited"; break;
+        case RunResult::FellOff: std::cerr << "Program ran past its last instruction"; break;
+        case RunResult::Limit:   std::cerr << "Stopped at the instruction limit"; break;
+        case RunResult::Error:   std::cerr << "Error: " << result.error; break;
+    }
+    double rate = result.seconds > 0 ? result.instructions / result.seconds : 0.0;
+    std::cerr << " after " << result.instructions << " instructions in "
+              << std::fixed << std::setprecision(3) << result.seconds << " s ("
+              << std::setprecision(1) << rate / 1e6 << " million instructions/s)" << std::endl;
+
+    if (dump_registers)
+    {
+        for (int r = 0; r < 32; r++)
+        {
+            std::cerr << std::left << std::setw(6) << REGISTER_NAMES[r] << std::right
+                      << std::setw(12) << static_cast<int32_t>(machine.reg(r))
+                      << ((r % 4 == 3) ? "\n" : "    ");
+        }
+        std::cerr << std::left << std::setw(6) << "hi" << std::right << std::setw(12) << static_cast<int32_t>(machine.hi_reg()) << "    "
+                  << std::left << std::setw(6) << "lo" << std::right << std::setw(12) << static_cast<int32_t>(machine.lo_reg()) << std::endl;
+    }
+
+    // A label's count is how often the instruction at it ran.
+    if (profile_path)
+    {
+        std::sort(labels.begin(), labels.end());
+        std::ofstream profile(profile_path);
+        profile << "# [file:]label and how many times the instruction at it ran\n";
+        for (const auto& label : labels)
+        {
+            uint64_t count = label.first / 4 < counts.size() ? counts[label.first / 4] : 0;
+            profile << label.second << " " << count << "\n";
+        }
+        if (!profile)
+        {
+            std::cerr << "Error: could not write profile: " << profile_path << std::endl;
+            return 1;
+        }
+    }
+
+    if (result.status == RunResult::Error) return 1;
+    return result.exit_code;
+}
@@ -0,0 +1,313 @@
+#ifndef __SIMULATOR_H__
+#define __SIMULATOR_H__
+
+#include "project1.h"
+#include "container.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/**
+ * Functional simulator for the binaries produced by assemble.
+ *
+ * Text and static memory live in separate address spaces that both start
+ * at 0, matching the addresses the assembler hands out: instruction i is at
+ * byte address 4*i (j/jal hold i itself), and .data starts at byte 0 of
+ * data memory. The stack grows down from the top of data memory.
+ *
+ * Every instruction word is decoded once into a Decoded record before the
+ * program starts. The interpreter then jumps straight from one record's
+ * handler to the next with computed gotos, so running an instruction costs
+ * one indirect branch and no decoding.
+ */
+
+enum class SimOp : uint8_t {
+    add, sub, slt, sltu, xor_, nor, sll, srl, sra, jr, jalr, syscall, mult, div, mfhi, mflo,
+    addi, sltiu, andi, ori, xori, lui, lw, sw, beq, bne, j, jal,
+    halt,     // one past the last instruction
+    invalid,  // a word that is not an instruction we know
+    count
+};
+
+// Writes to $zero go to this extra register so handlers never need to check.
+constexpr uint8_t SINK_REGISTER = 32;
+
+struct Decoded {
+    const void *handler;  // filled in by Machine::run
+    SimOp op;
+    uint8_t rd;           // destination (rt for I-type), SINK_REGISTER for $zero
+    uint8_t rs;
+    uint8_t rt;
+    int32_t imm;          // immediate, shift amount, or absolute instruction index for branches/jumps
+};
+
+//Decode one instruction word; index is its instruction number and count the text size
+inline Decoded decode_instruction(uint32_t word, uint32_t index, uint32_t count) {
+    Decoded d {nullptr, SimOp::invalid, 0, 0, 0, 0};
+    uint32_t opcode = word >> 26;
+    uint8_t rs = (word >> 21) & 31, rt = (word >> 16) & 31, rd = (word >> 11) & 31;
+    int32_t simm = static_cast<int16_t>(word & 0xFFFF);
+    auto dest = [](uint8_t r) { return r == 0 ? SINK_REGISTER : r; };
+    // Branch and jump targets outside the program all land on the halt record.
+    auto target = [&](int64_t t) { return static_cast<int32_t>(t < 0 || t > count ? count : t); };
+
+    d.rs = rs;
+    d.rt = rt;
+    switch (opcode) {
+        case 0:
+            d.rd = dest(rd);
+            switch (word & 63) {
+                case 32: d.op = SimOp::add; break;
+                case 34: d.op = SimOp::sub; break;
+                case 42: d.op = SimOp::slt; break;
+                case 43: d.op = SimOp::sltu; break;
+                case 38: d.op = SimOp::xor_; break;
+                case 39: d.op = SimOp::nor; break;
+                case 0:  d.op = SimOp::sll; d.imm = (word >> 6) & 31; break;
+                case 2:  d.op = SimOp::srl; d.imm = (word >> 6) & 31; break;
+                case 3:  d.op = SimOp::sra; d.imm = (word >> 6) & 31; break;
+                case 8:  d.op = SimOp::jr; break;
+                case 9:  d.op = SimOp::jalr; break;
+                case 12: d.op = SimOp::syscall; break;
+                case 24: d.op = SimOp::mult; break;
+                case 26: d.op = SimOp::div; break;
+                case 16: d.op = SimOp::mfhi; break;
+                case 18: d.op = SimOp::mflo; break;
+            }
+            break;
+        case 8:  d.op = SimOp::addi; d.rd = dest(rt); d.imm = simm; break;
+        case 11: d.op = SimOp::sltiu; d.rd = dest(rt); d.imm = simm; break;
+        case 12: d.op = SimOp::andi; d.rd = dest(rt); d.imm = static_cast<int32_t>(word & 0xFFFF); break;
+        case 14: d.op = SimOp::xori; d.rd = dest(rt); d.imm = static_cast<int32_t>(word & 0xFFFF); break;
+        case 35: d.op = SimOp::lw;   d.rd = dest(rt); d.imm = simm; break;
+        case 43: d.op = SimOp::sw;   d.imm = simm; break;
+        case 15: d.op = SimOp::lui;  d.rd = dest(rt); d.imm = static_cast<int32_t>((word & 0xFFFF) << 16); break;
+        case 13: d.op = SimOp::ori;  d.rd = dest(rt); d.imm = static_cast<int32_t>(word & 0xFFFF); break;
+        case 4:  d.op = SimOp::beq;  d.imm = target(int64_t(index) + 1 + simm); break;
+        case 5:  d.op = SimOp::bne;  d.imm = target(int64_t(index) + 1 + simm); break;
+        case 2:  d.op = SimOp::j;    d.imm = target(word & 0x3FFFFFF); break;
+        case 3:  d.op = SimOp::jal;  d.imm = target(word & 0x3FFFFFF); break;
+    }
+    return d;
+}
+
+//Copy bytes into 32-bit words, converting from the given byte order
+inline void copy_words(std::string_view bytes, Endian endian, std::vector<uint32_t> &words) {
+    words.resize(bytes.size() / 4);
+    std::memcpy(words.data(), bytes.data(), words.size() * 4);
+    if (endian != host_endian()) {
+        for (uint32_t &w : words) w = __builtin_bswap32(w);
+    }
+}
+
+//Read a binary file of 32-bit words in the given byte order
+inline bool read_words(const char *path, Endian endian, std::vector<uint32_t> &words) {
+    MappedFile file(path);
+    if (!file.ok()) return false;
+    copy_words(file.contents(), endian, words);
+    return true;
+}
+
+//Read the text and static memory of a program container, which names its own byte order
+inline bool read_container(const char *path, std::vector<uint32_t> &text, std::vector<uint32_t> &static_memory) {
+    MappedFile file(path);
+    ContainerView program(file.contents());
+    if (!file.ok() || !program.ok()) return false;
+    copy_words(program.section(SectionKind::Text), program.endian(), text);
+    copy_words(program.section(SectionKind::Data), program.endian(), static_memory);
+    return true;
+}
+
+/**
+ * Receives every memory access a run makes: instruction fetches by byte
+ * address, and lw/sw data addresses together with the issuing pc. The
+ * default does nothing and compiles away.
+ */
+struct NoTrace {
+    void fetch(uint32_t) {}
+    void load(uint32_t, uint32_t) {}
+    void store(uint32_t, uint32_t) {}
+};
+
+struct RunResult {
+    enum Status { Exited, FellOff, Limit, Error } status;
+    uint64_t instructions;  // instructions executed
+    double seconds;         // wall time spent in the interpreter
+    int exit_code;
+    std::string error;      // set when status == Error
+};
+
+class Machine {
+public:
+    Machine(const std::vector<uint32_t> &text, const std::vector<uint32_t> &static_memory, size_t memory_bytes)
+        : memory(memory_bytes, 0) {
+        uint32_t count = static_cast<uint32_t>(text.size());
+        code.reserve(text.size() + 1);
+        for (uint32_t i = 0; i < count; i++) code.push_back(decode_instruction(text[i], i, count));
+        code.push_back(Decoded {nullptr, SimOp::halt, 0, 0, 0, 0});
+
+        size_t static_bytes = std::min(memory.size(), static_memory.size() * 4);
+        std::memcpy(memory.data(), static_memory.data(), static_bytes);
+        regs[29] = static_cast<uint32_t>(memory.size());  // $sp
+    }
+
+    uint32_t reg(int r) const { return regs[r]; }
+    uint32_t hi_reg() const { return hi; }
+    uint32_t lo_reg() const { return lo; }
+
+    //Run until the program exits, leaves its text, or max_instructions have run (0 = no limit)
+    template <class Trace>
+    RunResult run(Trace &trace, uint64_t max_instructions = 0, std::ostream &out = std::cout);
+
+    RunResult run(uint64_t max_instructions = 0, std::ostream &out = std::cout) {
+        NoTrace trace;
+        return run(trace, max_instructions, out);
+    }
+
+    uint32_t text_size() const { return static_cast<uint32_t>(code.size() - 1); }
+
+private:
+    bool data_address(uint32_t addr, const char *what, std::string &error) const {
+        if ((addr & 3) == 0 && addr <= memory.size() - 4 && memory.size() >= 4) return true;
+        error = std::string(what) + " of invalid data address " + std::to_string(addr);
+        return false;
+    }
+
+    std::vector<Decoded> code;
+    std::vector<uint8_t> memory;
+    uint32_t regs[33] = {0};
+    uint32_t hi = 0, lo = 0;
+};
+
+template <class Trace>
+RunResult Machine::run(Trace &trace, uint64_t max_instructions, std::ostream &out) {
+    static const void *const handlers[] = {
+        &&op_add, &&op_sub, &&op_slt, &&op_sltu, &&op_xor, &&op_nor, &&op_sll, &&op_srl, &&op_sra, &&op_jr, &&op_jalr,
+        &&op_syscall, &&op_mult, &&op_div, &&op_mfhi, &&op_mflo,
+        &&op_addi, &&op_sltiu, &&op_andi, &&op_ori, &&op_xori, &&op_lui, &&op_lw, &&op_sw, &&op_beq, &&op_bne, &&op_j, &&op_jal,
+        &&op_halt, &&op_invalid
+    };
+    static_assert(sizeof(handlers) / sizeof(handlers[0]) == static_cast<size_t>(SimOp::count),
+                  "one handler per SimOp");
+    for (Decoded &d : code) d.handler = handlers[static_cast<size_t>(d.op)];
+
+    RunResult result {RunResult::Error, 0, 0.0, 0, ""};
+    const Decoded *const base = code.data();
+    const Decoded *ip = base;
+    const uint32_t count = static_cast<uint32_t>(code.size() - 1);
+    uint64_t remaining = max_instructions ? max_instructions : UINT64_MAX;
+    uint64_t executed = 0;
+    uint32_t *const r = regs;
+    auto start = std::chrono::steady_clock::now();
+
+#define PC() (static_cast<uint32_t>(ip - base) * 4)
+#define DISPATCH() do { if (executed == remaining) goto limit; executed++; trace.fetch(PC()); goto *ip->handler; } while (0)
+#define NEXT() do { ip++; DISPATCH(); } while (0)
+#define JUMP(index) do { ip = base + (index); DISPATCH(); } while (0)
+
+    DISPATCH();
+
+op_add:  r[ip->rd] = r[ip->rs] + r[ip->rt]; NEXT();
+op_sub:  r[ip->rd] = r[ip->rs] - r[ip->rt]; NEXT();
+op_slt:  r[ip->rd] = static_cast<int32_t>(r[ip->rs]) < static_cast<int32_t>(r[ip->rt]); NEXT();
+op_sltu: r[ip->rd] = r[ip->rs] < r[ip->rt]; NEXT();
+op_xor:  r[ip->rd] = r[ip->rs] ^ r[ip->rt]; NEXT();
+op_nor:  r[ip->rd] = ~(r[ip->rs] | r[ip->rt]); NEXT();
+op_sll:  r[ip->rd] = r[ip->rt] << ip->imm; NEXT();
+op_srl:  r[ip->rd] = r[ip->rt] >> ip->imm; NEXT();
+op_sra:  r[ip->rd] = static_cast<uint32_t>(static_cast<int32_t>(r[ip->rt]) >> ip->imm); NEXT();
+op_addi: r[ip->rd] = r[ip->rs] + static_cast<uint32_t>(ip->imm); NEXT();
+op_lui:  r[ip->rd] = static_cast<uint32_t>(ip->imm); NEXT();
+op_sltiu: r[ip->rd] = r[ip->rs] < static_cast<uint32_t>(ip->imm); NEXT();
+op_andi: r[ip->rd] = r[ip->rs] & static_cast<uint32_t>(ip->imm); NEXT();
+op_ori:  r[ip->rd] = r[ip->rs] | static_cast<uint32_t>(ip->imm); NEXT();
+op_xori: r[ip->rd] = r[ip->rs] ^ static_cast<uint32_t>(ip->imm); NEXT();
+op_mfhi: r[ip->rd] = hi; NEXT();
+op_mflo: r[ip->rd] = lo; NEXT();
+op_mult: {
+    int64_t product = int64_t(static_cast<int32_t>(r[ip->rs])) * static_cast<int32_t>(r[ip->rt]);
+    lo = static_cast<uint32_t>(product);
+    hi = static_cast<uint32_t>(static_cast<uint64_t>(product) >> 32);
+    NEXT();
+}
+op_div: {
+    // Division by zero leaves HI and LO unchanged (the result is undefined on MIPS).
+    int32_t a = static_cast<int32_t>(r[ip->rs]), b = static_cast<int32_t>(r[ip->rt]);
+    if (b != 0 && !(a == INT32_MIN && b == -1)) {
+        lo = static_cast<uint32_t>(a / b);
+        hi = static_cast<uint32_t>(a % b);
+    }
+    NEXT();
+}
+op_lw: {
+    uint32_t addr = r[ip->rs] + static_cast<uint32_t>(ip->imm);
+    if (!data_address(addr, "load", result.error)) goto fault;
+    trace.load(PC(), addr);
+    std::memcpy(&r[ip->rd], &memory[addr], 4);
+    NEXT();
+}
+op_sw: {
+    uint32_t addr = r[ip->rs] + static_cast<uint32_t>(ip->imm);
+    if (!data_address(addr, "store", result.error)) goto fault;
+    trace.store(PC(), addr);
+    std::memcpy(&memory[addr], &r[ip->rt], 4);
+    NEXT();
+}
+op_beq: if (r[ip->rs] == r[ip->rt]) JUMP(ip->imm); NEXT();
+op_bne: if (r[ip->rs] != r[ip->rt]) JUMP(ip->imm); NEXT();
+op_j:   JUMP(ip->imm);
+op_jal: r[31] = static_cast<uint32_t>(ip - base + 1) * 4; JUMP(ip->imm);
+op_jr:
+op_jalr: {
+    uint32_t addr = r[ip->rs];
+    if (ip->op == SimOp::jalr) r[ip->rd] = static_cast<uint32_t>(ip - base + 1) * 4;
+    if ((addr & 3) != 0 || addr / 4 > count) {
+        result.error = "jump to invalid instruction address " + std::to_string(addr);
+        goto fault;
+    }
+    JUMP(addr / 4);
+}
+op_syscall:
+    switch (r[2]) {
+        case 1:  out << static_cast<int32_t>(r[4]); break;   // print_int
+        case 4: {                                              // print_string
+            for (uint32_t a = r[4]; a < memory.size() && memory[a]; a++) out.put(static_cast<char>(memory[a]));
+            break;
+        }
+        case 10: result.status = RunResult::Exited; goto done;  // exit
+        case 11: out.put(static_cast<char>(r[4])); break;     // print_char
+        case 17: result.status = RunResult::Exited; result.exit_code = static_cast<int32_t>(r[4]); goto done;
+        default:
+            result.error = "unsupported syscall " + std::to_string(r[2]);
+            goto fault;
+    }
+    NEXT();
+op_halt:
+    executed--;
+    result.status = RunResult::FellOff;
+    goto done;
+op_invalid:
+    result.error = "invalid instruction";
+    goto fault;
+limit:
+    result.status = RunResult::Limit;
+    goto done;
+fault:
+    result.status = RunResult::Error;
+    result.error += " at instruction " + std::to_string(ip - base);
+done:
+#undef PC
+#undef DISPATCH
+#undef NEXT
+#undef JUMP
+    regs[SINK_REGISTER] = 0;
+    result.instructions = executed;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+#endif